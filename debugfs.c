@@ -0,0 +1,179 @@
+/*
+ *   debugfs.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "emu3_fs.h"
+
+//Free runs of 1, 2-3, 4-7... clusters. Cluster numbers fit in a short.
+#define EMU3_FREE_RUN_ORDERS 16
+
+static struct dentry *emu3_debugfs_root;
+
+//The cluster list lock must be held.
+static void emu3_show_free_runs(struct seq_file *m, struct emu3_sb_info *info)
+{
+	int i;
+	unsigned long start, end, run, largest = 0, runs = 0;
+	unsigned int hist[EMU3_FREE_RUN_ORDERS] = { 0 };
+
+	start = find_next_zero_bit(info->cluster_bitmap, info->clusters + 1, 1);
+	while (start <= info->clusters) {
+		end = find_next_bit(info->cluster_bitmap, info->clusters + 1,
+				    start);
+		run = end - start;
+		largest = max(largest, run);
+		hist[min_t(int, ilog2(run), EMU3_FREE_RUN_ORDERS - 1)]++;
+		runs++;
+		start = find_next_zero_bit(info->cluster_bitmap,
+					   info->clusters + 1, end);
+	}
+
+	seq_printf(m, "clusters: %u\n", info->clusters);
+	seq_printf(m, "free clusters: %u\n", info->free_clusters);
+	seq_printf(m, "reserved clusters: %u\n", info->reserved_clusters);
+	seq_printf(m, "free runs: %lu\n", runs);
+	seq_printf(m, "largest free run: %lu\n", largest);
+	seq_puts(m, "free run histogram:\n");
+	for (i = 0; i < EMU3_FREE_RUN_ORDERS; i++)
+		if (hist[i])
+			seq_printf(m, "  %lu-%lu: %u\n", 1UL << i,
+				   (2UL << i) - 1, hist[i]);
+}
+
+//Counts the extents of a file by walking its cluster chain. The cluster list lock must be held.
+//The cluster list pages not loaded yet are loaded, so reading the report may read the whole list.
+static void emu3_show_file(struct seq_file *m, struct emu3_sb_info *info,
+			   struct emu3_dentry *e3d_dir, struct emu3_dentry *e3d)
+{
+	int clusters = 0, extents = 0;
+	short prev = 0, next = le16_to_cpu(e3d->data.fattrs.start_cluster);
+
+	while (next >= 1 && next <= info->clusters
+	       && clusters < info->clusters) {
+		if (!clusters || next != prev + 1)
+			extents++;
+		clusters++;
+		prev = next;
+		next = emu3_get_next_cluster(info, next);
+		if (next == EMU_LAST_FILE_CLUSTER)
+			break;
+	}
+
+	seq_printf(m, "%.16s/%.16s: bank %d, %d clusters, %d extents%s\n",
+		   e3d_dir->name, e3d->name, e3d->data.id, clusters, extents,
+		   next == EMU_LAST_FILE_CLUSTER ? "" : " (broken chain)");
+}
+
+//The lock must be held.
+static int emu3_show_dir(struct seq_file *m, struct super_block *sb,
+			 struct emu3_dentry *e3d_dir)
+{
+	int i, j;
+	short blknum;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++) {
+		blknum = le16_to_cpu(e3d_dir->data.dattrs.block_list[i]);
+		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
+			break;
+
+		b = emu3_bread(sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			return -EIO;
+		}
+
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++)
+			if (EMU3_DENTRY_IS_FILE(e3d))
+				emu3_show_file(m, EMU3_SB(sb), e3d_dir, e3d);
+		brelse(b);
+	}
+
+	return 0;
+}
+
+static int emu3_fragmentation_show(struct seq_file *m, void *v)
+{
+	int i, j, blknum, err = 0;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct super_block *sb = m->private;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	err = emu3_wait_cluster_list_scan(info);
+	if (err)
+		return err;
+
+	down_read(&info->lock);
+	down_read(&info->cluster_lock);
+
+	emu3_show_free_runs(m, info);
+
+	seq_puts(m, "files:\n");
+	for (i = 0; i < info->root_blocks && !err; i++) {
+		blknum = info->start_root_block + i;
+		b = emu3_bread(sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			err = -EIO;
+			break;
+		}
+
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK && !err; j++, e3d++)
+			if (EMU3_DENTRY_IS_DIR(e3d))
+				err = emu3_show_dir(m, sb, e3d);
+		brelse(b);
+	}
+
+	up_read(&info->cluster_lock);
+	up_read(&info->lock);
+
+	return err;
+}
+
+DEFINE_SHOW_ATTRIBUTE(emu3_fragmentation);
+
+void emu3_debugfs_register(struct super_block *sb)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	info->debugfs_dir = debugfs_create_dir(sb->s_id, emu3_debugfs_root);
+	debugfs_create_file("fragmentation", 0444, info->debugfs_dir, sb,
+			    &emu3_fragmentation_fops);
+}
+
+void emu3_debugfs_unregister(struct super_block *sb)
+{
+	debugfs_remove_recursive(EMU3_SB(sb)->debugfs_dir);
+}
+
+void emu3_debugfs_init(void)
+{
+	emu3_debugfs_root = debugfs_create_dir(EMU3_MODULE_NAME, NULL);
+}
+
+void emu3_debugfs_exit(void)
+{
+	debugfs_remove_recursive(emu3_debugfs_root);
+}
@@ -0,0 +1,409 @@
+/*
+ *   defrag.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "emu3_fs.h"
+
+struct emu3_bank {
+	unsigned int dnum;
+	unsigned char id;
+};
+
+static inline sector_t emu3_cluster_to_dev_block(struct super_block *sb,
+						 short cluster)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	return (info->start_data_block +
+		(cluster - 1) * info->blocks_per_cluster) >> EMU3_BLOCK_SHIFT(sb);
+}
+
+//Copies the logical cluster n of the inode to the cluster dst.
+//The data is read through the page cache as the block device buffers of file data might be stale.
+static int emu3_copy_cluster(struct inode *inode, int n, short dst)
+{
+	int i;
+	loff_t pos;
+	struct page *page;
+	struct buffer_head *dbh;
+	struct super_block *sb = inode->i_sb;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	sector_t to = emu3_cluster_to_dev_block(sb, dst);
+
+	//Clusters are aligned to the device blocks.
+	for (i = 0; i < info->blocks_per_cluster >> EMU3_BLOCK_SHIFT(sb); i++) {
+		pos = ((loff_t)n << info->cluster_size_shift) +
+		    ((loff_t)i << sb->s_blocksize_bits);
+		page = read_mapping_page(inode->i_mapping, pos >> PAGE_SHIFT,
+					 NULL);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		dbh = sb_getblk(sb, to + i);
+		if (!dbh) {
+			put_page(page);
+			return -ENOMEM;
+		}
+
+		lock_buffer(dbh);
+		memcpy(dbh->b_data, kmap(page) + offset_in_page(pos),
+		       sb->s_blocksize);
+		kunmap(page);
+		set_buffer_uptodate(dbh);
+		unlock_buffer(dbh);
+		mark_buffer_dirty(dbh);
+
+		brelse(dbh);
+		put_page(page);
+	}
+
+	return 0;
+}
+
+//Drops the block device buffers of the run, as file writes do not go through them.
+//Buffers still dirty, if copying failed, are dropped too, so that they do not overwrite the data of the next file using the run.
+static void emu3_forget_run(struct super_block *sb, short run, int clusters)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	loff_t start = (loff_t)emu3_cluster_to_dev_block(sb, run) <<
+	    sb->s_blocksize_bits;
+	loff_t end = start + ((loff_t)clusters << info->cluster_size_shift) - 1;
+
+	truncate_inode_pages_range(sb->s_bdev->bd_inode->i_mapping, start, end);
+}
+
+//Takes a free run for the clusters of the inode. The cluster list lock must be held for writing.
+//If compacting, the first free run is used and only if it is before the current one.
+static int emu3_take_free_run(struct inode *inode, int clusters, bool compact)
+{
+	int i, err, extents;
+	unsigned long run;
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+
+	err = emu3_scan_cluster_list(info);
+	if (err)
+		return err;
+
+	extents = emu3_get_nr_extents(inode);
+	if (extents < 0)
+		return extents;
+
+	if (compact)
+		run = emu3_find_free_run(info, 1, clusters);
+	else {
+		if (extents == 1)
+			return 0;
+		run = emu3_find_free_run(info, info->next_free_cluster,
+					 clusters);
+		if (run >= info->clusters)
+			run = emu3_find_free_run(info, 1, clusters);
+	}
+
+	if (run >= info->clusters
+	    || info->free_clusters < info->reserved_clusters + clusters)
+		return compact ? 0 : -ENOSPC;
+
+	if (compact && extents == 1 && run > EMU3_I_START_CLUSTER(inode))
+		return 0;
+
+	for (i = 0; i < clusters; i++) {
+		err = emu3_set_cluster(info, run + i, i < clusters - 1 ?
+				       run + i + 1 : EMU_LAST_FILE_CLUSTER);
+		if (err) {
+			while (i--)
+				emu3_set_cluster(info, run + i, 0);
+			return err;
+		}
+	}
+
+	return run;
+}
+
+static void emu3_free_run(struct emu3_sb_info *info, int run, int clusters)
+{
+	int i;
+
+	down_write(&info->cluster_lock);
+	for (i = 0; i < clusters; i++)
+		emu3_set_cluster(info, run + i, 0);
+	up_write(&info->cluster_lock);
+}
+
+//Moves the inode clusters to a single free run. The inode must be locked, which keeps direct I/O out.
+static int emu3_defrag_inode(struct inode *inode, bool compact)
+{
+	int i, err, run, clusters;
+	struct buffer_head *bh;
+	struct emu3_dentry *e3d;
+	struct super_block *sb = inode->i_sb;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	struct address_space *mapping = inode->i_mapping;
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	//Files mapped after the check cannot fault pages in until the clusters are moved.
+	down_write(&e3i->mmap_lock);
+	if (mapping_mapped(mapping)) {
+		err = -EBUSY;
+		goto end;
+	}
+
+	inode_dio_wait(inode);
+	err = filemap_write_and_wait(mapping);
+	if (err)
+		goto end;
+
+	down_write(&info->cluster_lock);
+	clusters = emu3_get_clusters(inode);
+	run = clusters < 0 ? clusters :
+	    emu3_take_free_run(inode, clusters, compact);
+	up_write(&info->cluster_lock);
+	if (run <= 0) {
+		err = run;
+		goto end;
+	}
+
+	//The data is written to the new run before it is used.
+	for (i = 0; i < clusters; i++) {
+		err = emu3_copy_cluster(inode, i, run + i);
+		if (err)
+			goto error;
+	}
+	err = sync_blockdev(sb->s_bdev);
+	if (err)
+		goto error;
+	emu3_forget_run(sb, run, clusters);
+
+	down_read(&info->lock);
+	e3d = emu3_find_dentry_by_inode(inode, &bh);
+	if (!e3d) {
+		up_read(&info->lock);
+		err = -ENOENT;
+		goto error;
+	}
+
+	down_write(&info->cluster_lock);
+	emu3_clear_cluster_list(inode);
+	e3d->data.fattrs.start_cluster = cpu_to_le16(run);
+	EMU3_I(inode)->data.fattrs.start_cluster = cpu_to_le16(run);
+	emu3_truncate_extents(inode, 0);
+	up_write(&info->cluster_lock);
+
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	up_read(&info->lock);
+
+	//Cached pages may have buffers mapped to the old clusters.
+	truncate_inode_pages(mapping, 0);
+	goto end;
+
+ error:
+	emu3_forget_run(sb, run, clusters);
+	emu3_free_run(info, run, clusters);
+ end:
+	up_write(&e3i->mmap_lock);
+	return err;
+}
+
+static int emu3_bank_cmp(const void *a, const void *b)
+{
+	return ((const struct emu3_bank *)a)->id -
+	    ((const struct emu3_bank *)b)->id;
+}
+
+//Returns the files in the directory sorted by bank number. The lock must be held.
+static int emu3_get_banks(struct super_block *sb, struct emu3_dentry *e3d_dir,
+			  struct emu3_bank *banks)
+{
+	int i, j, count = 0;
+	short blknum;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++) {
+		blknum = le16_to_cpu(e3d_dir->data.dattrs.block_list[i]);
+		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
+			break;
+
+		b = emu3_bread(sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			return -EIO;
+		}
+
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+			if (!EMU3_DENTRY_IS_FILE(e3d))
+				continue;
+			banks[count].dnum = EMU3_DNUM(blknum, j);
+			banks[count].id = e3d->data.id;
+			count++;
+		}
+		brelse(b);
+	}
+
+	sort(banks, count, sizeof(struct emu3_bank), emu3_bank_cmp, NULL);
+	return count;
+}
+
+//Gets the inode of a bank only if its dentry is still a file, so that no inode map is added for removed ones.
+//The lock must be held.
+static struct inode *emu3_get_bank_inode(struct super_block *sb,
+					 unsigned int dnum)
+{
+	long ino;
+	bool file;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	unsigned int blknum = EMU3_DNUM_BLKNUM(dnum);
+
+	b = emu3_bread(sb, blknum);
+	if (!b) {
+		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
+		return ERR_PTR(-EIO);
+	}
+	e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
+	e3d += EMU3_DNUM_OFFSET(dnum);
+	file = EMU3_DENTRY_IS_FILE(e3d);
+	brelse(b);
+
+	if (!file)
+		return ERR_PTR(-ENOENT);
+	ino = emu3_get_or_add_i_map(EMU3_SB(sb), dnum);
+	if (ino < 0)
+		return ERR_PTR(ino);
+	return emu3_get_inode(sb, ino);
+}
+
+//Moves every file, directory by directory and in bank number order, to the first free run.
+static int emu3_compact(struct super_block *sb)
+{
+	int i, j, k, blknum, count, err = 0;
+	struct inode *inode;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct emu3_bank *banks;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	banks = kmalloc_array(EMU3_MAX_FILES_PER_DIR, sizeof(struct emu3_bank),
+			      GFP_KERNEL);
+	if (!banks)
+		return -ENOMEM;
+
+	for (i = 0; i < info->root_blocks; i++) {
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++) {
+			down_read(&info->lock);
+			blknum = info->start_root_block + i;
+			b = emu3_bread(sb, blknum);
+			if (!b) {
+				up_read(&info->lock);
+				err = -EIO;
+				goto end;
+			}
+			e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
+			e3d += j;
+			count = EMU3_DENTRY_IS_DIR(e3d) ?
+			    emu3_get_banks(sb, e3d, banks) : 0;
+			brelse(b);
+			up_read(&info->lock);
+
+			if (count < 0) {
+				err = count;
+				goto end;
+			}
+
+			for (k = 0; k < count; k++) {
+				down_read(&info->lock);
+				inode = emu3_get_bank_inode(sb, banks[k].dnum);
+				up_read(&info->lock);
+				//The file might have been removed meanwhile.
+				if (IS_ERR(inode))
+					continue;
+
+				inode_lock(inode);
+				err = emu3_defrag_inode(inode, true);
+				inode_unlock(inode);
+				iput(inode);
+
+				if (err == -EBUSY)
+					err = 0;
+				if (err)
+					goto end;
+				if (fatal_signal_pending(current)) {
+					err = -EINTR;
+					goto end;
+				}
+			}
+		}
+	}
+
+ end:
+	kfree(banks);
+	return err;
+}
+
+long emu3_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	long err;
+	struct fstrim_range range;
+	struct inode *inode = file_inode(file);
+
+	switch (cmd) {
+	case EMU3_IOC_DEFRAG:
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+
+		err = mnt_want_write_file(file);
+		if (err)
+			return err;
+		inode_lock(inode);
+		err = emu3_defrag_inode(inode, false);
+		inode_unlock(inode);
+		mnt_drop_write_file(file);
+		return err;
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&range, (struct fstrim_range __user *)arg,
+				   sizeof(range)))
+			return -EFAULT;
+
+		err = emu3_trim_fs(inode->i_sb, &range);
+		if (err)
+			return err;
+		if (copy_to_user((struct fstrim_range __user *)arg, &range,
+				 sizeof(range)))
+			return -EFAULT;
+		return 0;
+	case EMU3_IOC_COMPACT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		err = mnt_want_write_file(file);
+		if (err)
+			return err;
+		err = emu3_compact(inode->i_sb);
+		mnt_drop_write_file(file);
+		return err;
+	default:
+		return -ENOTTY;
+	}
+}
@@ -74,13 +74,13 @@ static struct emu3_dentry *emu3_find_dentry_by_name_in_blk(struct inode *dir, st
 	unsigned int i;
 	struct emu3_dentry *e3d;
 
-	*b = sb_bread(dir->i_sb, blknum);
+	*b = emu3_bread(dir->i_sb, blknum);
 	if (!*b) {
 		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
 		return NULL;
 	}
 
-	e3d = (struct emu3_dentry *)(*b)->b_data;
+	e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(*b, blknum);
 	for (i = 0; i < EMU3_ENTRIES_PER_BLOCK; i++, e3d++) {
 		if (!EMU3_DENTRY_IS_DIR(e3d) && !EMU3_DENTRY_IS_FILE(e3d))
 			continue;
@@ -144,26 +144,307 @@ static struct emu3_dentry *emu3_find_dentry_by_name(struct inode *dir,
 	return res;
 }
 
+//Position of an entry in the directory, which is the order used by the devices.
+static unsigned int emu3_dir_pos(struct inode *dir, unsigned int dnum)
+{
+	int i;
+	struct emu3_inode *e3i = EMU3_I(dir);
+	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+
+	if (EMU3_IS_I_ROOT_DIR(dir))
+		return EMU3_DNUM_INDEX(info, dnum);
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++)
+		if (le16_to_cpu(e3i->data.dattrs.block_list[i]) ==
+		    EMU3_DNUM_BLKNUM(dnum))
+			return i * EMU3_ENTRIES_PER_BLOCK +
+			    EMU3_DNUM_OFFSET(dnum);
+
+	return UINT_MAX;
+}
+
+//Repeated bank numbers are reported when building the index and when they are set.
+static void emu3_dir_index_get_id(struct emu3_dir_index *index,
+				  struct emu3_dir_entry *e)
+{
+	if (e->id < 0)
+		return;
+
+	if (!index->id_refs[e->id]++)
+		__set_bit(e->id, index->ids);
+	else
+		printk(KERN_INFO "%s: bank number %d is repeated\n",
+		       EMU3_MODULE_NAME, e->id);
+}
+
+static void emu3_dir_index_put_id(struct emu3_dir_index *index,
+				  struct emu3_dir_entry *e)
+{
+	if (e->id < 0)
+		return;
+
+	if (!--index->id_refs[e->id])
+		__clear_bit(e->id, index->ids);
+}
+
+static int emu3_dir_index_add(struct emu3_dir_index *index,
+			      struct emu3_dentry *e3d, unsigned int dnum,
+			      unsigned int pos)
+{
+	int len;
+	struct emu3_dir_entry *e;
+	char fixed[EMU3_LENGTH_FILENAME];
+
+	emu3_filename_fix(e3d->name, fixed);
+	len = emu3_filename_length(fixed);
+	if (len < 0)
+		return 0;
+
+	e = kmalloc(sizeof(struct emu3_dir_entry), GFP_NOFS);
+	if (!e)
+		return -ENOMEM;
+
+	e->dnum = dnum;
+	e->pos = pos;
+	e->id = EMU3_DENTRY_IS_FILE(e3d) ? e3d->data.id : -1;
+	e->len = len;
+	memcpy(e->name, fixed, len);
+	hash_add(index->entries, &e->node, full_name_hash(NULL, e->name, len));
+	emu3_dir_index_get_id(index, e);
+
+	return 0;
+}
+
+static void emu3_dir_index_destroy(struct emu3_dir_index *index)
+{
+	int i;
+	struct hlist_node *tmp;
+	struct emu3_dir_entry *e;
+
+	hash_for_each_safe(index->entries, i, tmp, e, node) {
+		hash_del(&e->node);
+		kfree(e);
+	}
+	kfree(index);
+}
+
+static int emu3_dir_index_add_blk(struct inode *dir,
+				  struct emu3_dir_index *index,
+				  unsigned int blknum, unsigned int pos)
+{
+	int i, err = 0;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+
+	b = emu3_bread(dir->i_sb, blknum);
+	if (!b) {
+		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
+		return -EIO;
+	}
+
+	e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
+	for (i = 0; i < EMU3_ENTRIES_PER_BLOCK; i++, e3d++) {
+		if (!EMU3_DENTRY_IS_DIR(e3d) && !EMU3_DENTRY_IS_FILE(e3d))
+			continue;
+
+		err = emu3_dir_index_add(index, e3d, EMU3_DNUM(blknum, i),
+					 pos + i);
+		if (err)
+			break;
+	}
+
+	brelse(b);
+	return err;
+}
+
+static struct emu3_dir_index *emu3_build_dir_index(struct inode *dir)
+{
+	int i, err = 0;
+	short blknum;
+	struct buffer_head *db;
+	struct emu3_dentry *e3d;
+	struct emu3_dir_index *index;
+	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+
+	index = kzalloc(sizeof(struct emu3_dir_index), GFP_NOFS);
+	if (!index)
+		return ERR_PTR(-ENOMEM);
+	hash_init(index->entries);
+
+	if (EMU3_IS_I_ROOT_DIR(dir)) {
+		for (i = 0; i < info->root_blocks && !err; i++)
+			err = emu3_dir_index_add_blk(dir, index,
+						     info->start_root_block + i,
+						     i * EMU3_ENTRIES_PER_BLOCK);
+		goto end;
+	}
+
+	e3d = emu3_find_dentry_by_inode(dir, &db);
+	if (!e3d) {
+		err = -EIO;
+		goto end;
+	}
+
+	if (EMU3_DENTRY_IS_DIR(e3d)) {
+		for (i = 0; i < EMU3_BLOCKS_PER_DIR && !err; i++) {
+			blknum = le16_to_cpu(e3d->data.dattrs.block_list[i]);
+			if (EMU3_IS_DIR_BLOCK_FREE(blknum))
+				break;
+
+			err = emu3_dir_index_add_blk(dir, index, blknum,
+						     i * EMU3_ENTRIES_PER_BLOCK);
+		}
+	}
+
+	brelse(db);
+
+ end:
+	if (err) {
+		emu3_dir_index_destroy(index);
+		return ERR_PTR(err);
+	}
+	return index;
+}
+
+//Lookups run in parallel so the first built index is the one installed.
+static struct emu3_dir_index *emu3_get_dir_index(struct inode *dir)
+{
+	struct emu3_inode *e3i = EMU3_I(dir);
+	struct emu3_dir_index *index, *old;
+
+	index = READ_ONCE(e3i->dir_index);
+	if (index)
+		return index;
+
+	index = emu3_build_dir_index(dir);
+	if (IS_ERR(index))
+		return index;
+
+	old = cmpxchg(&e3i->dir_index, NULL, index);
+	if (old) {
+		emu3_dir_index_destroy(index);
+		return old;
+	}
+	return index;
+}
+
+//Returns 1 if found, 0 if not found and a negative value if the index is not available.
+static int emu3_find_dnum_by_name(struct inode *dir, const struct qstr *q,
+				  unsigned int *dnum)
+{
+	unsigned int len = q->len;
+	struct emu3_dir_entry *e, *found = NULL;
+	struct emu3_dir_index *index = emu3_get_dir_index(dir);
+
+	if (IS_ERR(index))
+		return PTR_ERR(index);
+
+	//Names are padded with spaces so trailing spaces are not significant.
+	while (len && q->name[len - 1] == ' ')
+		len--;
+
+	hash_for_each_possible(index->entries, e, node,
+			       full_name_hash(NULL, q->name, len)) {
+		if (e->len != len || memcmp(e->name, q->name, len))
+			continue;
+		//With repeated names, the first one is used.
+		if (!found || e->pos < found->pos)
+			found = e;
+	}
+
+	if (!found)
+		return 0;
+
+	*dnum = found->dnum;
+	return 1;
+}
+
+static void emu3_dir_index_insert(struct inode *dir, struct emu3_dentry *e3d,
+				  unsigned int dnum)
+{
+	struct emu3_inode *e3i = EMU3_I(dir);
+
+	if (!e3i->dir_index)
+		return;
+
+	if (emu3_dir_index_add(e3i->dir_index, e3d, dnum,
+			       emu3_dir_pos(dir, dnum))) {
+		//It will be built again on the next lookup.
+		emu3_free_dir_index(dir);
+	}
+}
+
+static void emu3_dir_index_remove(struct inode *dir, unsigned int dnum)
+{
+	int i;
+	struct hlist_node *tmp;
+	struct emu3_dir_entry *e;
+	struct emu3_inode *e3i = EMU3_I(dir);
+
+	if (!e3i->dir_index)
+		return;
+
+	hash_for_each_safe(e3i->dir_index->entries, i, tmp, e, node) {
+		if (e->dnum == dnum) {
+			emu3_dir_index_put_id(e3i->dir_index, e);
+			hash_del(&e->node);
+			kfree(e);
+		}
+	}
+}
+
+void emu3_dir_index_set_id(struct inode *dir, unsigned int dnum,
+			   unsigned char id)
+{
+	int i;
+	struct emu3_dir_entry *e;
+	struct emu3_inode *e3i = EMU3_I(dir);
+
+	if (!e3i->dir_index)
+		return;
+
+	hash_for_each(e3i->dir_index->entries, i, e, node) {
+		if (e->dnum != dnum || e->id < 0)
+			continue;
+
+		emu3_dir_index_put_id(e3i->dir_index, e);
+		e->id = id;
+		emu3_dir_index_get_id(e3i->dir_index, e);
+		return;
+	}
+}
+
+void emu3_free_dir_index(struct inode *inode)
+{
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	if (e3i->dir_index) {
+		emu3_dir_index_destroy(e3i->dir_index);
+		e3i->dir_index = NULL;
+	}
+}
+
 static int emu3_emit(struct dir_context *ctx,
 		     struct emu3_dentry *e3d, unsigned int blknum,
 		     unsigned int offset, unsigned type,
 		     struct emu3_sb_info *info)
 {
 	int len;
-	unsigned long ino;
+	long ino;
 	char fixed[EMU3_LENGTH_FILENAME];
 
 	emu3_filename_fix(e3d->name, fixed);
 	len = emu3_filename_length(fixed);
 	ino = emu3_get_or_add_i_map(info, EMU3_DNUM(blknum, offset));
-	ctx->pos++;
+	if (ino < 0)
+		return 0;
 	return dir_emit(ctx, fixed, len, ino, type);
 }
 
+//The position encodes the block index and the offset so the iteration resumes where it was.
 static int emu3_iterate_dir(struct file *f, struct dir_context *ctx,
 			    struct inode *dir, struct emu3_sb_info *info)
 {
-	loff_t k;
 	unsigned int i, j;
 	short blknum;
 	struct buffer_head *b;
@@ -171,83 +452,80 @@ static int emu3_iterate_dir(struct file *f, struct dir_context *ctx,
 	struct emu3_dentry *e3d;
 	struct emu3_dentry *e3d_dir;
 
-	k = 2;
 	e3d_dir = emu3_find_dentry_by_inode(dir, &db);
 
 	if (!EMU3_DENTRY_IS_DIR(e3d_dir))
 		goto cleanup;
 
-	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++) {
+	i = EMU3_DIR_POS_BLOCK(ctx->pos);
+	j = EMU3_DIR_POS_OFFSET(ctx->pos);
+	for (; i < EMU3_BLOCKS_PER_DIR; i++, j = 0) {
 		blknum = le16_to_cpu(e3d_dir->data.dattrs.block_list[i]);
 		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
 			break;
 
-		b = sb_bread(dir->i_sb, blknum);
+		b = emu3_bread(dir->i_sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
 			goto cleanup;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
-		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum) + j;
+		for (; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
 			if (!EMU3_DENTRY_IS_FILE(e3d))
 				continue;
 
-			if (ctx->pos == k) {
-				if (!emu3_emit
-				    (ctx, e3d, blknum, j, DT_REG, info)) {
-					brelse(b);
-					goto cleanup;
-				}
+			ctx->pos = EMU3_DIR_POS(i, j);
+			if (!emu3_emit(ctx, e3d, blknum, j, DT_REG, info)) {
+				brelse(b);
+				goto cleanup;
 			}
-			k++;
 		}
 		brelse(b);
 	}
+	ctx->pos = EMU3_DIR_POS(i, 0);
 
  cleanup:
 	brelse(db);
-	return k;
+	return 0;
 }
 
 static int emu3_iterate_root(struct file *f, struct dir_context *ctx,
 			     struct inode *dir, struct emu3_sb_info *info)
 {
-	loff_t k;
 	unsigned int i, j, blknum;
 	struct emu3_dentry *e3d;
 	struct buffer_head *b;
 
-	k = 2;
-	for (i = 0; i < info->root_blocks; i++) {
+	i = EMU3_DIR_POS_BLOCK(ctx->pos);
+	j = EMU3_DIR_POS_OFFSET(ctx->pos);
+	for (; i < info->root_blocks; i++, j = 0) {
 		blknum = info->start_root_block + i;
-		b = sb_bread(dir->i_sb, blknum);
+		b = emu3_bread(dir->i_sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
-			break;
+			return 0;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum) + j;
 
-		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+		for (; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
 			if (!EMU3_DENTRY_IS_DIR(e3d))
 				continue;
 
-			if (ctx->pos == k) {
-				if (!emu3_emit
-				    (ctx, e3d, blknum, j, DT_DIR, info)) {
-					brelse(b);
-					return k;
-				}
+			ctx->pos = EMU3_DIR_POS(i, j);
+			if (!emu3_emit(ctx, e3d, blknum, j, DT_DIR, info)) {
+				brelse(b);
+				return 0;
 			}
-			k++;
 		}
 		brelse(b);
 	}
+	ctx->pos = EMU3_DIR_POS(i, 0);
 
-	return k;
+	return 0;
 }
 
 static int emu3_iterate(struct file *f, struct dir_context *ctx)
@@ -279,7 +557,8 @@ static int emu3_iterate(struct file *f, struct dir_context *ctx)
 static struct dentry *emu3_lookup(struct inode *dir,
 				  struct dentry *dentry, unsigned int flags)
 {
-	unsigned long i_ino;
+	int found;
+	long i_ino;
 	unsigned int dnum;
 	struct buffer_head *b;
 	struct emu3_dentry *e3d;
@@ -290,26 +569,34 @@ static struct dentry *emu3_lookup(struct inode *dir,
 	if (dentry->d_name.len > EMU3_LENGTH_FILENAME)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	mutex_lock(&info->lock);
+	down_read(&info->lock);
 
-	e3d = emu3_find_dentry_by_name(dir, dentry, &b, &dnum);
-	if (e3d) {
-		brelse(b);
+	found = emu3_find_dnum_by_name(dir, &dentry->d_name, &dnum);
+	if (found < 0) {
+		e3d = emu3_find_dentry_by_name(dir, dentry, &b, &dnum);
+		if (e3d)
+			brelse(b);
+		found = e3d != NULL;
+	}
+
+	if (found) {
 		i_ino = emu3_get_or_add_i_map(info, dnum);
-		inode = emu3_get_inode(dir->i_sb, i_ino);
+		inode = i_ino < 0 ? ERR_PTR(i_ino) :
+		    emu3_get_inode(dir->i_sb, i_ino);
 		if (IS_ERR(inode)) {
-			mutex_unlock(&info->lock);
+			up_read(&info->lock);
 			return ERR_CAST(inode);
 		}
 	}
 	newent = d_splice_alias(inode, dentry);
 
-	mutex_unlock(&info->lock);
+	up_read(&info->lock);
 
 	return newent;
 }
 
-static int emu3_get_free_file_id(struct inode *dir)
+//Used only if the directory index is not available
+static int emu3_find_free_file_id(struct inode *dir)
 {
 	int i, j, id = -1;
 	short *block;
@@ -337,14 +624,14 @@ static int emu3_get_free_file_id(struct inode *dir)
 		if (!EMU3_DIR_BLOCK_OK(blknum, info))
 			break;
 
-		b = sb_bread(dir->i_sb, blknum);
+		b = emu3_bread(dir->i_sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
 			goto cleanup;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
 
 		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
 			if (EMU3_DENTRY_IS_FILE(e3d))
@@ -365,6 +652,18 @@ static int emu3_get_free_file_id(struct inode *dir)
 	return id;
 }
 
+static int emu3_get_free_file_id(struct inode *dir)
+{
+	int id;
+	struct emu3_dir_index *index = emu3_get_dir_index(dir);
+
+	if (IS_ERR(index))
+		return emu3_find_free_file_id(dir);
+
+	id = find_first_zero_bit(index->ids, EMU3_MAX_FILES_PER_DIR);
+	return id < EMU3_MAX_FILES_PER_DIR ? id : -1;
+}
+
 static int emu3_find_empty_file_dentry(struct inode *dir,
 				       struct emu3_dentry **e3d,
 				       struct buffer_head **b,
@@ -393,7 +692,7 @@ static int emu3_find_empty_file_dentry(struct inode *dir,
 		if (!EMU3_DIR_BLOCK_OK(blknum, info))
 			break;
 
-		*b = sb_bread(dir->i_sb, blknum);
+		*b = emu3_bread(dir->i_sb, blknum);
 		if (!*b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
@@ -401,7 +700,7 @@ static int emu3_find_empty_file_dentry(struct inode *dir,
 			goto cleanup;
 		}
 
-		*e3d = (struct emu3_dentry *)(*b)->b_data;
+		*e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(*b, blknum);
 		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, (*e3d)++) {
 			if (!EMU3_DENTRY_IS_FILE(*e3d)) {
 				*dnum = EMU3_DNUM(blknum, j);
@@ -427,7 +726,7 @@ static int emu3_find_empty_file_dentry(struct inode *dir,
 	emu3_set_emu3_inode_data(dir, e3d_dir);
 	mark_buffer_dirty_inode(db, dir);
 
-	*b = sb_bread(dir->i_sb, blknum);
+	*b = emu3_bread(dir->i_sb, blknum);
 	if (!*b) {
 		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
 		err = -EIO;
@@ -436,7 +735,7 @@ static int emu3_find_empty_file_dentry(struct inode *dir,
 
 	*dnum = EMU3_DNUM(blknum, 0);
 
-	*e3d = (struct emu3_dentry *)(*b)->b_data;
+	*e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(*b, blknum);
 
 	dir->i_blocks++;
 	dir->i_size = dir->i_blocks * EMU3_BSIZE;
@@ -475,13 +774,31 @@ static int emu3_add_file_dentry(struct inode *dir, struct dentry *dentry,
 	if (dentry->d_name.len > EMU3_LENGTH_FILENAME)
 		return -ENAMETOOLONG;
 
-	start_cluster = emu3_next_free_cluster(info);
+	//The first cluster is taken now as other files may be growing meanwhile.
+	down_write(&info->cluster_lock);
+	start_cluster = emu3_scan_cluster_list(info);
+	if (!start_cluster) {
+		if (info->free_clusters <= info->reserved_clusters)
+			start_cluster = -ENOSPC;
+		else
+			start_cluster = emu3_next_free_cluster(info);
+	}
+	if (start_cluster >= 0)
+		err = emu3_set_cluster(info, start_cluster,
+				       EMU_LAST_FILE_CLUSTER);
+	up_write(&info->cluster_lock);
 	if (start_cluster < 0)
-		return -ENOSPC;
+		return start_cluster;
+	if (err)
+		return err;
 
 	err = emu3_find_empty_file_dentry(dir, e3d, b, dnum);
-	if (err)
+	if (err) {
+		down_write(&info->cluster_lock);
+		emu3_set_cluster(info, start_cluster, 0);
+		up_write(&info->cluster_lock);
 		return err;
+	}
 
 	emu3_set_dentry_name(*e3d, &dentry->d_name);
 	//The id is set in emu3_find_empty_file_dentry
@@ -500,6 +817,7 @@ static int emu3_create(struct inode *dir,
 #endif
 {
 	int err;
+	long ino;
 	unsigned int dnum;
 	struct inode *inode;
 	struct buffer_head *b;
@@ -507,7 +825,7 @@ static int emu3_create(struct inode *dir,
 	struct super_block *sb = dir->i_sb;
 	struct emu3_sb_info *info = EMU3_SB(sb);
 
-	mutex_lock(&info->lock);
+	down_write(&info->lock);
 
 	//Files are not allowed at root
 	if (EMU3_IS_I_ROOT_DIR(dir)) {
@@ -521,8 +839,16 @@ static int emu3_create(struct inode *dir,
 		goto end;
 	}
 
+	ino = emu3_reserve_i_map(info);
+	if (ino < 0) {
+		iput(inode);
+		err = ino;
+		goto end;
+	}
+
 	err = emu3_add_file_dentry(dir, dentry, &dnum, &e3d, &b);
 	if (err) {
+		emu3_cancel_i_map(info, ino);
 		iput(inode);
 		goto end;
 	}
@@ -534,16 +860,16 @@ static int emu3_create(struct inode *dir,
 	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
 	inode->i_blocks = info->blocks_per_cluster;
 	inode->i_op = &emu3_inode_operations_file;
-	inode->i_fop = &emu3_file_operations_file;
 	inode->i_opflags |= IOP_XATTR;
-	inode->i_mapping->a_ops = &emu3_aops;
-	inode->i_ino = emu3_get_or_add_i_map(info, dnum);
+	emu3_set_file_operations(inode);
+	inode->i_ino = emu3_add_i_map(info, dnum, ino);
 	inode->i_size = 0;
 
 	emu3_set_emu3_inode_data(inode, e3d);
+	emu3_dir_index_insert(dir, e3d, dnum);
 	brelse(b);
 
-	emu3_init_cluster_list(inode);
+	info->free_inodes--;
 
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
@@ -551,7 +877,7 @@ static int emu3_create(struct inode *dir,
 	d_instantiate(dentry, inode);
 
  end:
-	mutex_unlock(&info->lock);
+	up_write(&info->lock);
 	return err;
 }
 
@@ -580,14 +906,14 @@ static bool emu3_is_dir_empty(struct emu3_dentry *e3d_dir,
 		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
 			break;
 
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
 			return 0;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
 
 		if (emu3_is_dir_blk_used(e3d)) {
 			brelse(b);
@@ -612,14 +938,14 @@ static struct emu3_dentry *emu3_find_empty_dir_dentry(struct super_block *sb,
 	for (i = 0; i < info->root_blocks; i++) {
 		blknum = info->start_root_block + i;
 
-		*b = sb_bread(sb, blknum);
+		*b = emu3_bread(sb, blknum);
 		if (!*b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
 			return NULL;
 		}
 
-		e3d = (struct emu3_dentry *)(*b)->b_data;
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(*b, blknum);
 
 		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
 			if (!EMU3_DENTRY_IS_DIR(e3d)) {
@@ -685,17 +1011,19 @@ static int emu3_unlink(struct inode *dir, struct dentry *dentry)
 	if (e3d == NULL)
 		return -ENOENT;
 
-	mutex_lock(&info->lock);
+	down_write(&info->lock);
 
 	e3d->data.fattrs.type = EMU3_FTYPE_DEL;
 	mark_buffer_dirty_inode(b, dir);
+	info->free_inodes++;
+	emu3_dir_index_remove(dir, emu3_get_i_map(info, inode));
 	dir->i_ctime = dir->i_mtime = current_time(dir);
 	mark_inode_dirty(dir);
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
 	brelse(b);
 
-	mutex_unlock(&info->lock);
+	up_write(&info->lock);
 
 	return 0;
 }
@@ -712,7 +1040,7 @@ static int emu3_rename(struct inode *old_dir,
 {
 	int err = 0;
 	unsigned char id;
-	unsigned int dnum = 0;
+	unsigned int old_dnum, dnum = 0;
 	struct super_block *sb = old_dentry->d_inode->i_sb;
 	struct emu3_sb_info *info = EMU3_SB(sb);
 	struct buffer_head *old_b, *new_b;
@@ -721,7 +1049,7 @@ static int emu3_rename(struct inode *old_dir,
 	if (flags & ~RENAME_NOREPLACE)
 		return -EINVAL;
 
-	mutex_lock(&info->lock);
+	down_write(&info->lock);
 
 	if (EMU3_IS_I_ROOT_DIR(old_dir) && !EMU3_IS_I_ROOT_DIR(new_dir)) {
 		//The emu3 filesystem does not allow directories in directories.
@@ -741,6 +1069,8 @@ static int emu3_rename(struct inode *old_dir,
 			if (old_dir == new_dir) {
 				new_e3d->data.fattrs.type = EMU3_FTYPE_DEL;
 				mark_buffer_dirty_inode(new_b, new_dir);
+				if (S_ISREG(new_dentry->d_inode->i_mode))
+					info->free_inodes++;
 				new_dir->i_mtime = current_time(new_dir);
 				mark_inode_dirty(new_dir);
 			}
@@ -752,6 +1082,8 @@ static int emu3_rename(struct inode *old_dir,
 		brelse(new_b);
 
 		dnum = emu3_get_i_map(info, new_dentry->d_inode);
+		if (old_dir == new_dir)
+			emu3_dir_index_remove(new_dir, dnum);
 		inode_dec_link_count(new_dentry->d_inode);
 		d_delete(new_dentry);
 	}
@@ -762,8 +1094,12 @@ static int emu3_rename(struct inode *old_dir,
 		goto end;
 	}
 
+	old_dnum = emu3_get_i_map(info, old_dentry->d_inode);
+
 	if (old_dir == new_dir) {
 		emu3_set_dentry_name(old_e3d, &new_dentry->d_name);
+		emu3_dir_index_remove(old_dir, old_dnum);
+		emu3_dir_index_insert(old_dir, old_e3d, old_dnum);
 		mark_buffer_dirty_inode(old_b, old_dir);
 		old_dir->i_mtime = current_time(old_dir);
 		mark_inode_dirty(old_dir);
@@ -775,12 +1111,14 @@ static int emu3_rename(struct inode *old_dir,
 							  &new_b, &dnum);
 			if (err)
 				goto cleanup;
+			info->free_inodes--;
 
 			id = new_e3d->data.id;
 			memcpy(new_e3d, old_e3d, sizeof(struct emu3_dentry));
 			new_e3d->data.id = id;
 
 			emu3_set_emu3_inode_data(old_dentry->d_inode, new_e3d);
+			emu3_dir_index_insert(new_dir, new_e3d, dnum);
 
 			new_dir->i_mtime = current_time(new_dir);
 			mark_buffer_dirty_inode(new_b, new_dir);
@@ -790,6 +1128,8 @@ static int emu3_rename(struct inode *old_dir,
 
 		old_e3d->data.fattrs.type = EMU3_FTYPE_DEL;
 		mark_buffer_dirty_inode(old_b, old_dir);
+		info->free_inodes++;
+		emu3_dir_index_remove(old_dir, old_dnum);
 		old_dir->i_mtime = current_time(old_dir);
 		mark_inode_dirty(old_dir);
 	}
@@ -797,7 +1137,7 @@ static int emu3_rename(struct inode *old_dir,
  cleanup:
 	brelse(old_b);
  end:
-	mutex_unlock(&info->lock);
+	up_write(&info->lock);
 	return err;
 }
 
@@ -809,6 +1149,7 @@ static int emu3_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 #endif
 {
 	int err;
+	long ino;
 	unsigned int dnum;
 	struct inode *inode;
 	struct buffer_head *b;
@@ -823,12 +1164,19 @@ static int emu3_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	if (!inode)
 		return -ENOSPC;
 
-	mutex_lock(&info->lock);
+	ino = emu3_reserve_i_map(info);
+	if (ino < 0) {
+		iput(inode);
+		return ino;
+	}
+
+	down_write(&info->lock);
 
 	err = emu3_add_dir_dentry(dir, &dentry->d_name, &dnum, &e3d, &b);
 
 	if (err) {
-		mutex_unlock(&info->lock);
+		up_write(&info->lock);
+		emu3_cancel_i_map(info, ino);
 		iput(inode);
 		return err;
 	}
@@ -841,19 +1189,21 @@ static int emu3_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	inode->i_op = &emu3_inode_operations_dir;
 	inode->i_fop = &emu3_file_operations_dir;
 	inode->i_opflags &= ~IOP_XATTR;
-	inode->i_ino = emu3_get_or_add_i_map(info, dnum);
+	inode->i_ino = emu3_add_i_map(info, dnum, ino);
 	inode->i_size = EMU3_BSIZE;
 	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
 
 	emu3_set_emu3_inode_data(inode, e3d);
+	emu3_dir_index_insert(dir, e3d, dnum);
 	brelse(b);
+	info->free_inodes--;
 
 	set_nlink(inode, 2);
 	inode_inc_link_count(dir);
 
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
-	mutex_unlock(&info->lock);
+	up_write(&info->lock);
 
 	d_instantiate(dentry, inode);
 
@@ -869,7 +1219,7 @@ static int emu3_rmdir(struct inode *dir, struct dentry *dentry)
 	struct inode *inode = d_inode(dentry);
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 
-	mutex_lock(&info->lock);
+	down_write(&info->lock);
 
 	e3d = emu3_find_dentry_by_inode(inode, &b);
 	if (!e3d) {
@@ -898,6 +1248,8 @@ static int emu3_rmdir(struct inode *dir, struct dentry *dentry)
 
 	memset(e3d, 0, sizeof(struct emu3_dentry));
 	mark_buffer_dirty_inode(b, dir);
+	info->free_inodes++;
+	emu3_dir_index_remove(dir, emu3_get_i_map(info, inode));
 	emu3_clear_i_map(info, inode);
 	inode_dec_link_count(inode);
 	inode_dec_link_count(inode);
@@ -905,7 +1257,7 @@ static int emu3_rmdir(struct inode *dir, struct dentry *dentry)
  cleanup:
 	brelse(b);
  end:
-	mutex_unlock(&info->lock);
+	up_write(&info->lock);
 	return ret;
 }
 
@@ -914,6 +1266,7 @@ const struct file_operations emu3_file_operations_dir = {
 	.iterate = emu3_iterate,
 	.fsync = generic_file_fsync,
 	.llseek = generic_file_llseek,
+	.unlocked_ioctl = emu3_ioctl,
 };
 
 const struct inode_operations emu3_inode_operations_dir = {
@@ -21,10 +21,23 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
 #include <linux/string.h>
 #include <linux/vfs.h>
 #include <linux/writeback.h>
 #include <linux/version.h>
+#include <linux/hashtable.h>
+#include <linux/iomap.h>
+#include <linux/fiemap.h>
+#include <linux/falloc.h>
+#include <linux/sort.h>
+#include <linux/mount.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
+#include <linux/uaccess.h>
 
 #define EMU3_MODULE_NAME "emu3fs"
 
@@ -33,7 +46,15 @@
 
 #define EMU3_BSIZE_BITS 9
 #define EMU3_BSIZE (1 << EMU3_BSIZE_BITS)
+//EMU3 blocks are always 512 B. On devices with bigger logical blocks, the device block containing them is read.
+#define EMU3_BLOCK_SHIFT(sb) ((sb)->s_blocksize_bits - EMU3_BSIZE_BITS)
+#define emu3_bread(sb, blknum) sb_bread(sb, (blknum) >> EMU3_BLOCK_SHIFT(sb))
+#define EMU3_BLOCK_DATA(b, blknum) ((b)->b_data + (((blknum) << EMU3_BSIZE_BITS) & ((b)->b_size - 1)))
+
 #define EMU3_CLUSTER_ENTRIES_PER_BLOCK  (EMU3_BSIZE >> 1)
+#define EMU3_CLUSTER_ENTRIES_PER_PAGE  (PAGE_SIZE >> 1)
+#define EMU3_CLUSTER_BLOCKS_PER_PAGE  (PAGE_SIZE >> EMU3_BSIZE_BITS)
+#define EMU3_CLUSTER_PAGES(info) DIV_ROUND_UP((info)->cluster_list_blocks, EMU3_CLUSTER_BLOCKS_PER_PAGE)
 
 #define EMU3_I_ID_ROOT_DIR 1	//Any value is valid as long as is lower than the first inode ID.
 #define EMU3_I_ID_MAP_OFFSET (EMU3_I_ID_ROOT_DIR + 1)	//As inodes are mapped to emu3 dentries in an array, we need to add an offset greater than EMU3_ROOT_DIR_I_ID.
@@ -49,6 +70,11 @@
 #define EMU3_DNUM_BLKNUM(dnum) ((dnum) >> EMU3_DNUM_OFFSET_SIZE)
 #define EMU3_DNUM_OFFSET(dnum) ((dnum) & EMU3_DNUM_OFFSET_MASK)
 
+//Directory positions are the block index in the directory and the offset in the block, after '.' and '..'.
+#define EMU3_DIR_POS(i, offset) (EMU3_DNUM(i, offset) + 2)
+#define EMU3_DIR_POS_BLOCK(pos) EMU3_DNUM_BLKNUM((pos) - 2)
+#define EMU3_DIR_POS_OFFSET(pos) EMU3_DNUM_OFFSET((pos) - 2)
+
 #define EMU_LAST_FILE_CLUSTER ((short)0x7fff)
 
 #define EMU3_BLOCKS_PER_DIR 7
@@ -59,6 +85,9 @@
 
 #define EMU3_TOTAL_ENTRIES(info) (((info)->root_blocks + (info)->dir_content_blocks) * EMU3_ENTRIES_PER_BLOCK)
 
+//Root and dir content blocks are contiguous, which is checked when mounting, so every dnum has an index in [0, EMU3_TOTAL_ENTRIES).
+#define EMU3_DNUM_INDEX(info, dnum) ((EMU3_DNUM_BLKNUM(dnum) - (info)->start_root_block) * EMU3_ENTRIES_PER_BLOCK + EMU3_DNUM_OFFSET(dnum))
+
 //For devices, this should be 102, 100 regular banks + 2 special rom files with fixed ids at 0x6b and 0x6d.
 //We use the maximum physically allowed.
 #define EMU3_MAX_FILES_PER_DIR (EMU3_ENTRIES_PER_BLOCK * EMU3_BLOCKS_PER_DIR)
@@ -99,6 +128,8 @@
 #define EMU3_DIR_MODE (EMU3_COMMON_MODE | EMU3_DIR_MODE_)
 #define EMU3_FILE_MODE (EMU3_COMMON_MODE | EMU3_FILE_MODE_)
 
+#define EMU3_DIR_INDEX_BITS 6
+
 #define EMU3_FREE_DIR_BLOCK (-1)
 #define EMU3_IS_DIR_BLOCK_FREE(block) ((block) == EMU3_FREE_DIR_BLOCK)
 
@@ -106,6 +137,17 @@
 
 #define EMU3_ERR_NOT_BLK "%s: block %d not available\n"
 
+#define EMU3_IOC_DEFRAG _IO('e', 1)
+#define EMU3_IOC_COMPACT _IO('e', 2)
+
+#define EMU3_MOUNT_IOMAP 0x0001
+#define EMU3_MOUNT_DELALLOC 0x0002
+#define EMU3_MOUNT_DISCARD 0x0004
+
+#define emu3_test_opt(info, opt) ((info)->mount_opts & EMU3_MOUNT_##opt)
+#define emu3_set_opt(info, opt) ((info)->mount_opts |= EMU3_MOUNT_##opt)
+#define emu3_clear_opt(info, opt) ((info)->mount_opts &= ~EMU3_MOUNT_##opt)
+
 struct emu3_sb_info {
 	unsigned int blocks;
 	unsigned int start_root_block;
@@ -118,10 +160,30 @@ struct emu3_sb_info {
 	unsigned int blocks_per_cluster;
 	unsigned int clusters;
 	unsigned char cluster_size_shift;	//Cluster size always a power of 2
-	short *cluster_list;
+	unsigned int mount_opts;
+	unsigned int commit_interval;	//Seconds. 0 if only written on sync and unmount.
+	short **cluster_pages;	//Cluster list pages, loaded on demand
+	unsigned long *cluster_bitmap;	//Used clusters, built in the background after mounting
+	unsigned int scanned_clusters;	//Clusters below are in the bitmap and the free clusters
+	unsigned long *cluster_list_dirty;	//Modified cluster list blocks
+	unsigned long *discard_bitmap;	//Freed clusters not discarded yet
+	unsigned int next_free_cluster;
 	bool *dir_content_block_list;
-	unsigned int *i_maps;
-	struct mutex lock;
+	unsigned int *i_maps;	//Inode to dnum
+	unsigned long *i_maps_bitmap;	//Used inodes
+	unsigned long *d_maps;	//dnum index to inode
+	spinlock_t i_maps_lock;
+	//Counters kept up to date for statfs
+	unsigned int free_clusters;
+	unsigned int reserved_clusters;	//Delayed allocation
+	unsigned int free_dir_content_blocks;
+	unsigned int free_inodes;
+	struct rw_semaphore lock;	//Dentries and dir content blocks
+	struct rw_semaphore cluster_lock;	//Cluster list, bitmap and free clusters
+	struct dentry *debugfs_dir;
+	struct delayed_work commit_work;
+	struct work_struct scan_work;
+	struct super_block *sb;
 };
 
 struct emu3_file_attrs {
@@ -151,9 +213,39 @@ struct emu3_dentry {
 	struct emu3_dentry_data data;
 };
 
+//Physically contiguous run of clusters. All the values are in clusters.
+struct emu3_extent {
+	unsigned short start;	//First logical cluster
+	unsigned short cluster;	//First physical cluster
+	unsigned short clusters;
+};
+
+struct emu3_dir_entry {
+	struct hlist_node node;
+	unsigned int dnum;
+	unsigned int pos;	//Position in the directory
+	short id;		//Bank number. Negative if not a file.
+	unsigned char len;
+	char name[EMU3_LENGTH_FILENAME];	//As shown by readdir
+};
+
+//In-memory name and bank number index of a directory
+struct emu3_dir_index {
+	DECLARE_HASHTABLE(entries, EMU3_DIR_INDEX_BITS);
+	DECLARE_BITMAP(ids, EMU3_MAX_FILES_PER_DIR);	//Bank numbers in use
+	unsigned char id_refs[EMU3_MAX_FILES_PER_DIR];	//More than 1 means repeated
+};
+
 struct emu3_inode {
 	struct inode vfs_inode;
 	struct emu3_dentry_data data;
+	struct emu3_dir_index *dir_index;	//Only for directories. Built on first lookup.
+	struct rw_semaphore extents_lock;
+	struct rw_semaphore mmap_lock;	//Keeps page faults out while defragmenting
+	struct emu3_extent *extents;	//Built lazily from the cluster list
+	unsigned int nr_extents;	//0 means not built
+	unsigned int max_extents;
+	unsigned int reserved_clusters;	//Delayed allocation beyond the allocated clusters
 };
 
 extern const struct file_operations emu3_file_operations_dir;
@@ -166,22 +258,86 @@ extern const struct inode_operations emu3_inode_operations_file;
 
 extern const struct address_space_operations emu3_aops;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+extern const struct file_operations emu3_iomap_file_operations;
+
+extern const struct address_space_operations emu3_iomap_aops;
+
+extern const struct iomap_ops emu3_iomap_ops;
+#endif
+
 extern const struct xattr_handler *emu3_xattr_handlers[];
 
 struct inode *emu3_get_inode(struct super_block *, unsigned long);
 
 int emu3_next_free_cluster(struct emu3_sb_info *);
 
-void emu3_init_cluster_list(struct inode *);
+unsigned long emu3_find_free_run(struct emu3_sb_info *, unsigned long, int);
+
+int emu3_find_free_cluster(struct emu3_sb_info *, int, int);
+
+void emu3_clear_cluster_list(struct inode *);
+
+int emu3_reserve_clusters(struct inode *, sector_t);
+
+void emu3_release_clusters(struct inode *, unsigned int);
+
+short emu3_get_next_cluster(struct emu3_sb_info *, short);
+
+int emu3_set_cluster(struct emu3_sb_info *, short, short);
+
+int emu3_scan_cluster_list(struct emu3_sb_info *);
+
+int emu3_wait_cluster_list_scan(struct emu3_sb_info *);
+
+int emu3_trim_fs(struct super_block *, struct fstrim_range *);
+
+int __emu3_get_cluster(struct inode *, int);
+
+int emu3_get_extent(struct inode *, int, struct emu3_extent *);
 
 int emu3_get_cluster(struct inode *, int);
 
-sector_t emu3_get_phys_block(struct inode *, sector_t);
+int emu3_get_clusters(struct inode *);
+
+int emu3_get_nr_extents(struct inode *);
+
+void emu3_append_extent(struct inode *, int, short);
+
+void emu3_truncate_extents(struct inode *, int);
+
+void emu3_free_extents(struct inode *);
+
+unsigned int emu3_get_phys_blocks(struct inode *, sector_t, unsigned int,
+				  sector_t *);
+
+int emu3_alloc_clusters(struct inode *, sector_t);
+
+int emu3_alloc_delayed_clusters(struct inode *);
+
+void emu3_truncate_clusters(struct inode *);
+
+bool emu3_dio_align(struct kiocb *, struct iov_iter *, size_t *);
+
+long emu3_fallocate(struct file *, int, loff_t, loff_t);
+
+int emu3_release_file(struct inode *, struct file *);
+
+int emu3_file_mmap(struct file *, struct vm_area_struct *);
+
+void emu3_set_file_operations(struct inode *);
 
 struct emu3_dentry *emu3_find_dentry_by_inode(struct inode *,
 					      struct buffer_head **);
 
-unsigned long emu3_get_or_add_i_map(struct emu3_sb_info *, unsigned int);
+long emu3_get_or_add_i_map(struct emu3_sb_info *, unsigned int);
+
+long emu3_reserve_i_map(struct emu3_sb_info *);
+
+void emu3_cancel_i_map(struct emu3_sb_info *, unsigned long);
+
+unsigned long emu3_add_i_map(struct emu3_sb_info *, unsigned int,
+			     unsigned long);
 
 unsigned int emu3_get_i_map(struct emu3_sb_info *, struct inode *);
 
@@ -204,3 +360,17 @@ void emu3_init_fattrs(struct emu3_sb_info *, struct emu3_file_attrs *, short);
 void emu3_set_inode_blocks(struct inode *, struct emu3_file_attrs *);
 
 void emu3_prune_cluster_list(struct inode *);
+
+void emu3_free_dir_index(struct inode *);
+
+void emu3_dir_index_set_id(struct inode *, unsigned int, unsigned char);
+
+long emu3_ioctl(struct file *, unsigned int, unsigned long);
+
+void emu3_debugfs_register(struct super_block *);
+
+void emu3_debugfs_unregister(struct super_block *);
+
+void emu3_debugfs_init(void);
+
+void emu3_debugfs_exit(void);
@@ -0,0 +1,296 @@
+/*
+ *   extent.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "emu3_fs.h"
+
+#define EMU3_MIN_EXTENTS 8
+
+//Adds a cluster at the end of the extent map, merging it with the last extent if possible.
+static int emu3_add_extent(struct emu3_inode *e3i, short cluster)
+{
+	unsigned int max;
+	unsigned short start = 0;
+	struct emu3_extent *e;
+
+	if (e3i->nr_extents) {
+		e = &e3i->extents[e3i->nr_extents - 1];
+		if (e->cluster + e->clusters == cluster) {
+			e->clusters++;
+			return 0;
+		}
+		start = e->start + e->clusters;
+	}
+
+	if (e3i->nr_extents == e3i->max_extents) {
+		max = e3i->max_extents ? e3i->max_extents << 1 :
+		    EMU3_MIN_EXTENTS;
+		e = krealloc(e3i->extents, max * sizeof(struct emu3_extent),
+			     GFP_NOFS);
+		if (!e)
+			return -ENOMEM;
+		e3i->extents = e;
+		e3i->max_extents = max;
+	}
+
+	e = &e3i->extents[e3i->nr_extents++];
+	e->start = start;
+	e->cluster = cluster;
+	e->clusters = 1;
+	return 0;
+}
+
+static int emu3_build_extents(struct inode *inode)
+{
+	int i, err;
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	struct emu3_inode *e3i = EMU3_I(inode);
+	short next = EMU3_I_START_CLUSTER(inode);
+
+	for (i = 0; i < info->clusters; i++) {
+		if (next < 0) {
+			err = next;
+			goto error;
+		}
+		if (next < 1 || next > info->clusters) {
+			printk(KERN_CRIT "%s: Bad cluster %d in inode %ld\n",
+			       EMU3_MODULE_NAME, next, inode->i_ino);
+			err = -EIO;
+			goto error;
+		}
+
+		err = emu3_add_extent(e3i, next);
+		if (err)
+			goto error;
+
+		next = emu3_get_next_cluster(info, next);
+		if (next == EMU_LAST_FILE_CLUSTER)
+			return 0;
+	}
+
+	printk(KERN_CRIT "%s: Loop detected in cluster list\n",
+	       EMU3_MODULE_NAME);
+	err = -EIO;
+
+ error:
+	e3i->nr_extents = 0;
+	return err;
+}
+
+static inline int emu3_load_extents(struct inode *inode)
+{
+	if (EMU3_I(inode)->nr_extents)
+		return 0;
+	return emu3_build_extents(inode);
+}
+
+//Binary search of the extent containing the logical cluster n
+static struct emu3_extent *emu3_find_extent(struct emu3_inode *e3i, int n)
+{
+	struct emu3_extent *e;
+	int first = 0, last = e3i->nr_extents - 1, middle;
+
+	while (first <= last) {
+		middle = (first + last) >> 1;
+		e = &e3i->extents[middle];
+		if (n < e->start)
+			last = middle - 1;
+		else if (n >= e->start + e->clusters)
+			first = middle + 1;
+		else
+			return e;
+	}
+	return NULL;
+}
+
+//Used only if there is no memory for the extent map
+static int emu3_walk_cluster_list(struct inode *inode, int n)
+{
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	short next = EMU3_I_START_CLUSTER(inode);
+	int i = 0;
+
+	while (i < n) {
+		next = emu3_get_next_cluster(info, next);
+		if (next < 1 || next == EMU_LAST_FILE_CLUSTER)
+			return -1;
+		i++;
+	}
+	return next;
+}
+
+static int emu3_lookup_cluster(struct emu3_inode *e3i, int n)
+{
+	struct emu3_extent *e = emu3_find_extent(e3i, n);
+
+	return e ? e->cluster + n - e->start : -1;
+}
+
+//Base 0 search. The cluster list lock must be held.
+int __emu3_get_cluster(struct inode *inode, int n)
+{
+	int err, cluster;
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	down_write(&e3i->extents_lock);
+	err = emu3_load_extents(inode);
+	if (err) {
+		up_write(&e3i->extents_lock);
+		return err == -ENOMEM ? emu3_walk_cluster_list(inode, n) : -1;
+	}
+	cluster = emu3_lookup_cluster(e3i, n);
+	up_write(&e3i->extents_lock);
+
+	return cluster;
+}
+
+//Copies the extent containing the logical cluster n.
+//Once the extent map is built, the cluster list lock is not needed.
+int emu3_get_extent(struct inode *inode, int n, struct emu3_extent *extent)
+{
+	int err;
+	struct emu3_extent *e;
+	struct emu3_inode *e3i = EMU3_I(inode);
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+
+	down_read(&e3i->extents_lock);
+	if (e3i->nr_extents) {
+		e = emu3_find_extent(e3i, n);
+		if (e)
+			*extent = *e;
+		up_read(&e3i->extents_lock);
+		return e ? 0 : -ENOENT;
+	}
+	up_read(&e3i->extents_lock);
+
+	down_read(&info->cluster_lock);
+	down_write(&e3i->extents_lock);
+	err = emu3_load_extents(inode);
+	if (!err) {
+		e = emu3_find_extent(e3i, n);
+		if (e)
+			*extent = *e;
+		else
+			err = -ENOENT;
+	} else if (err == -ENOMEM) {
+		//Without extent map, only single cluster extents are available.
+		err = emu3_walk_cluster_list(inode, n);
+		if (err >= 0) {
+			extent->start = n;
+			extent->cluster = err;
+			extent->clusters = 1;
+			err = 0;
+		} else
+			err = -ENOENT;
+	}
+	up_write(&e3i->extents_lock);
+	up_read(&info->cluster_lock);
+
+	return err;
+}
+
+//Base 0 search
+int emu3_get_cluster(struct inode *inode, int n)
+{
+	struct emu3_extent e;
+
+	if (emu3_get_extent(inode, n, &e))
+		return -1;
+	return e.cluster + n - e.start;
+}
+
+//Amount of clusters in the inode cluster list. The cluster list lock must be held.
+int emu3_get_clusters(struct inode *inode)
+{
+	int err;
+	struct emu3_extent *e;
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	down_write(&e3i->extents_lock);
+	err = emu3_load_extents(inode);
+	if (!err) {
+		e = &e3i->extents[e3i->nr_extents - 1];
+		err = e->start + e->clusters;
+	}
+	up_write(&e3i->extents_lock);
+
+	return err;
+}
+
+//Amount of physically contiguous runs. The cluster list lock must be held.
+int emu3_get_nr_extents(struct inode *inode)
+{
+	int err;
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	down_write(&e3i->extents_lock);
+	err = emu3_load_extents(inode);
+	if (!err)
+		err = e3i->nr_extents;
+	up_write(&e3i->extents_lock);
+
+	return err;
+}
+
+//Keeps the extent map coherent when the cluster n is added at the end of the cluster list.
+void emu3_append_extent(struct inode *inode, int n, short cluster)
+{
+	struct emu3_extent *e;
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	down_write(&e3i->extents_lock);
+	if (e3i->nr_extents) {
+		e = &e3i->extents[e3i->nr_extents - 1];
+		if (e->start + e->clusters != n
+		    || emu3_add_extent(e3i, cluster))
+			e3i->nr_extents = 0;
+	}
+	up_write(&e3i->extents_lock);
+}
+
+//Keeps the extent map coherent when the cluster list is pruned to the given amount of clusters.
+void emu3_truncate_extents(struct inode *inode, int clusters)
+{
+	struct emu3_extent *e;
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	down_write(&e3i->extents_lock);
+	while (e3i->nr_extents) {
+		e = &e3i->extents[e3i->nr_extents - 1];
+		if (e->start < clusters) {
+			if (e->start + e->clusters > clusters)
+				e->clusters = clusters - e->start;
+			break;
+		}
+		e3i->nr_extents--;
+	}
+	up_write(&e3i->extents_lock);
+}
+
+void emu3_free_extents(struct inode *inode)
+{
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	down_write(&e3i->extents_lock);
+	kfree(e3i->extents);
+	e3i->extents = NULL;
+	e3i->nr_extents = 0;
+	e3i->max_extents = 0;
+	up_write(&e3i->extents_lock);
+}
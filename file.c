@@ -20,82 +20,388 @@
 
 #include "emu3_fs.h"
 
-//Base 0 search
+//Base 0 search. The cluster list lock must be held for writing.
 static int emu3_expand_cluster_list(struct inode *inode, sector_t block)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	struct emu3_inode *e3i = EMU3_I(inode);
 	int cluster = ((int)block) / info->blocks_per_cluster;
-	short next = EMU3_I_START_CLUSTER(inode);
-	int new, i = 0;
+	int err, new, i = emu3_get_clusters(inode);
+	short next;
 
-	while (le16_to_cpu(info->cluster_list[next]) != EMU_LAST_FILE_CLUSTER) {
-		next = le16_to_cpu(info->cluster_list[next]);
-		i++;
-	}
+	if (i < 0)
+		return i;
+
+	err = emu3_scan_cluster_list(info);
+	if (err)
+		return err;
+
+	next = __emu3_get_cluster(inode, --i);
 	while (i < cluster) {
-		new = emu3_next_free_cluster(info);
+		//Clusters reserved by other files are not available.
+		if (info->free_clusters <=
+		    info->reserved_clusters - e3i->reserved_clusters)
+			return -ENOSPC;
+		new = emu3_find_free_cluster(info, next + 1, cluster - i);
 		if (new < 0)
 			return -ENOSPC;
-		info->cluster_list[next] = cpu_to_le16(new);
+		//The new cluster page might need to be loaded.
+		err = emu3_set_cluster(info, new, EMU_LAST_FILE_CLUSTER);
+		if (err)
+			return err;
+		emu3_set_cluster(info, next, new);
+		emu3_release_clusters(inode, 1);
 		next = new;
 		i++;
+		emu3_append_extent(inode, i, new);
+		inode->i_blocks += info->blocks_per_cluster;
+		e3i->data.fattrs.clusters++;
 	}
-	info->cluster_list[next] = cpu_to_le16(EMU_LAST_FILE_CLUSTER);
 	return 0;
 }
 
+//Allocates all the clusters needed to map up to block.
+int emu3_alloc_clusters(struct inode *inode, sector_t block)
+{
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	int err;
+
+	down_write(&info->cluster_lock);
+	err = emu3_expand_cluster_list(inode, block);
+	up_write(&info->cluster_lock);
+
+	return err;
+}
+
+//Allocates the clusters reserved by delayed allocation up to the file size.
+int emu3_alloc_delayed_clusters(struct inode *inode)
+{
+	sector_t phys;
+	loff_t size = i_size_read(inode);
+	sector_t last = (size - 1) >> EMU3_BSIZE_BITS;
+
+	if (!READ_ONCE(EMU3_I(inode)->reserved_clusters) || !size)
+		return 0;
+	if (emu3_get_phys_blocks(inode, last, 1, &phys))
+		return 0;
+	return emu3_alloc_clusters(inode, last);
+}
+
 static int
 emu3_get_block(struct inode *inode, sector_t block,
 	       struct buffer_head *bh_result, int create)
 {
 	sector_t phys;
 	struct super_block *sb = inode->i_sb;
-	struct emu3_inode *e3i = EMU3_I(inode);
-	struct emu3_sb_info *info = EMU3_SB(sb);
+	unsigned int shift = EMU3_BLOCK_SHIFT(sb);
+	unsigned int blocks, max = bh_result->b_size >> EMU3_BSIZE_BITS;
 	int err;
 
-	phys = emu3_get_phys_block(inode, block);
-	if (phys != -1) {
-		map_bh(bh_result, sb, phys);
+	//The inode blocks might be bigger than the EMU3 blocks.
+	block <<= shift;
+
+	//Contiguous clusters are mapped at once so that large bios can be built.
+	blocks = emu3_get_phys_blocks(inode, block, max, &phys);
+	if (blocks) {
+		map_bh(bh_result, sb, phys >> shift);
+		bh_result->b_size = blocks << EMU3_BSIZE_BITS;
 		return 0;
 	}
 
 	if (!create)
 		return 0;
 
-	mutex_lock(&info->lock);
-	err = emu3_expand_cluster_list(inode, block);
-	mutex_unlock(&info->lock);
+	err = emu3_alloc_clusters(inode, block);
+	if (err)
+		return err;
+
+	//Direct I/O must not go beyond the run just allocated.
+	blocks = emu3_get_phys_blocks(inode, block, max, &phys);
+	if (!blocks)
+		return -ENOSPC;
+	map_bh(bh_result, sb, phys >> shift);
+	bh_result->b_size = blocks << EMU3_BSIZE_BITS;
+	set_buffer_new(bh_result);
+
+	return 0;
+}
+
+//Only reserves the clusters, which are allocated on writeback when the final size is known.
+static int
+emu3_get_block_delalloc(struct inode *inode, sector_t block,
+			struct buffer_head *bh_result, int create)
+{
+	sector_t phys;
+	int err;
+	unsigned int shift = EMU3_BLOCK_SHIFT(inode->i_sb);
 
+	block <<= shift;
+	if (emu3_get_phys_blocks(inode, block, 1, &phys)) {
+		map_bh(bh_result, inode->i_sb, phys >> shift);
+		return 0;
+	}
+
+	err = emu3_reserve_clusters(inode, block);
 	if (err)
 		return err;
-	else {
-		phys = emu3_get_phys_block(inode, block);
-		map_bh(bh_result, sb, phys);
-		inode->i_blocks += info->blocks_per_cluster;
-		e3i->data.fattrs.clusters++;
+
+	//Blocks beyond the allocated clusters have nothing to be read.
+	if (!buffer_uptodate(bh_result)) {
+		zero_user(bh_result->b_page, bh_offset(bh_result),
+			  bh_result->b_size);
+		set_buffer_uptodate(bh_result);
 	}
+	set_buffer_delay(bh_result);
 
 	return 0;
 }
 
 static int emu3_readpage(struct file *file, struct page *page)
 {
-	return block_read_full_page(page, emu3_get_block);
+	return mpage_readpage(page, emu3_get_block);
 }
 
+//Files are usually read from start to end so readahead builds bios as big as the cluster runs.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+static void emu3_readahead(struct readahead_control *rac)
+{
+	mpage_readahead(rac, emu3_get_block);
+}
+#else
+static int emu3_readpages(struct file *file, struct address_space *mapping,
+			  struct list_head *pages, unsigned nr_pages)
+{
+	return mpage_readpages(mapping, pages, nr_pages, emu3_get_block);
+}
+#endif
+
 static int emu3_writepage(struct page *page, struct writeback_control *wbc)
 {
 	return block_write_full_page(page, emu3_get_block, wbc);
 }
 
+//Any missing cluster up to the file size is allocated at once before writing the pages back.
+static int emu3_writepages(struct address_space *mapping,
+			   struct writeback_control *wbc)
+{
+	sector_t phys, last;
+	struct inode *inode = mapping->host;
+	loff_t size = i_size_read(inode);
+	int err;
+
+	if (size) {
+		last = (size - 1) >> EMU3_BSIZE_BITS;
+		if (!emu3_get_phys_blocks(inode, last, 1, &phys)) {
+			err = emu3_alloc_clusters(inode, last);
+			if (err)
+				return err;
+		}
+	}
+
+	return mpage_writepages(mapping, wbc, emu3_get_block);
+}
+
 static int
 emu3_write_begin(struct file *file, struct address_space *mapping,
 		 loff_t pos, unsigned len, unsigned flags,
 		 struct page **pagep, void **fsdata)
 {
+	struct emu3_sb_info *info = EMU3_SB(mapping->host->i_sb);
+
 	return block_write_begin(mapping, pos, len, flags, pagep,
-				 emu3_get_block);
+				 emu3_test_opt(info, DELALLOC) ?
+				 emu3_get_block_delalloc : emu3_get_block);
+}
+
+//Frees the clusters and the reservations beyond the file size.
+void emu3_truncate_clusters(struct inode *inode)
+{
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	//Delayed data may remain below the new size.
+	emu3_alloc_delayed_clusters(inode);
+
+	down_write(&info->cluster_lock);
+	emu3_set_fattrs(info, &e3i->data.fattrs, inode->i_size);
+	emu3_prune_cluster_list(inode);
+	inode->i_blocks = e3i->data.fattrs.clusters * info->blocks_per_cluster;
+	emu3_release_clusters(inode, UINT_MAX);
+	up_write(&info->cluster_lock);
+}
+
+//Limits the iterator to the part that can be done with direct I/O.
+//The remaining tail, which must be restored afterwards, is done through the page cache.
+bool emu3_dio_align(struct kiocb *iocb, struct iov_iter *iter, size_t *tail)
+{
+	unsigned int mask =
+	    bdev_logical_block_size(file_inode(iocb->ki_filp)->i_sb->s_bdev) -
+	    1;
+	size_t count = iov_iter_count(iter);
+	size_t aligned = count & ~((size_t)mask);
+
+	if ((iocb->ki_pos & mask) || !aligned)
+		return false;
+
+	iov_iter_truncate(iter, aligned);
+	if (iov_iter_alignment(iter) & mask) {
+		iov_iter_reexpand(iter, count);
+		return false;
+	}
+
+	*tail = count - aligned;
+	return true;
+}
+
+static ssize_t emu3_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	ssize_t ret;
+	size_t tail;
+	loff_t end = iocb->ki_pos + iov_iter_count(iter);
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	struct inode *inode = mapping->host;
+
+	//Returning 0 makes the generic code use buffered I/O.
+	if (!emu3_dio_align(iocb, iter, &tail))
+		return 0;
+
+	ret = blockdev_direct_IO(iocb, inode, iter, emu3_get_block);
+	iov_iter_reexpand(iter, iov_iter_count(iter) + tail);
+
+	if (ret < 0 && iov_iter_rw(iter) == WRITE && end > inode->i_size)
+		emu3_truncate_clusters(inode);
+
+	return ret;
+}
+
+//Zeroes on disk the blocks from the one following from up to to.
+static int emu3_zero_blocks(struct inode *inode, loff_t from, loff_t to)
+{
+	int err;
+	sector_t phys;
+	unsigned int blocks;
+	struct super_block *sb = inode->i_sb;
+	unsigned int shift = EMU3_BLOCK_SHIFT(sb);
+	sector_t block = ((from + sb->s_blocksize - 1) >> sb->s_blocksize_bits)
+	    << shift;
+	sector_t last = (to - 1) >> EMU3_BSIZE_BITS;
+
+	while (block <= last) {
+		blocks = emu3_get_phys_blocks(inode, block, last - block + 1,
+					      &phys);
+		if (!blocks)
+			return -EIO;
+		//The device blocks do not cross clusters.
+		err = sb_issue_zeroout(sb, phys >> shift,
+				       DIV_ROUND_UP(blocks, 1 << shift),
+				       GFP_NOFS);
+		if (err)
+			return err;
+		block += blocks;
+	}
+	return 0;
+}
+
+//All the clusters are added at once so that they can be contiguous.
+long emu3_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	int err;
+	loff_t size, end = offset + len;
+	struct inode *inode = file_inode(file);
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+
+	err = inode_newsize_ok(inode, end);
+	if (err)
+		goto end;
+
+	err = emu3_alloc_clusters(inode, (end - 1) >> EMU3_BSIZE_BITS);
+	if (err)
+		goto end;
+
+	size = i_size_read(inode);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > size) {
+		err = emu3_zero_blocks(inode, size, end);
+		if (err)
+			goto end;
+		truncate_setsize(inode, end);
+		inode->i_mtime = current_time(inode);
+	}
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+
+ end:
+	inode_unlock(inode);
+	return err;
+}
+
+//Faults wait while defragmentation moves the clusters of the file, so mapped pages are not written meanwhile.
+static vm_fault_t emu3_filemap_fault(struct vm_fault *vmf)
+{
+	vm_fault_t ret;
+	struct emu3_inode *e3i = EMU3_I(file_inode(vmf->vma->vm_file));
+
+	down_read(&e3i->mmap_lock);
+	ret = filemap_fault(vmf);
+	up_read(&e3i->mmap_lock);
+	return ret;
+}
+
+static vm_fault_t emu3_filemap_page_mkwrite(struct vm_fault *vmf)
+{
+	vm_fault_t ret;
+	struct emu3_inode *e3i = EMU3_I(file_inode(vmf->vma->vm_file));
+
+	down_read(&e3i->mmap_lock);
+	ret = filemap_page_mkwrite(vmf);
+	up_read(&e3i->mmap_lock);
+	return ret;
+}
+
+static const struct vm_operations_struct emu3_file_vm_ops = {
+	.fault = emu3_filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = emu3_filemap_page_mkwrite,
+};
+
+int emu3_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int err = generic_file_mmap(file, vma);
+
+	if (!err)
+		vma->vm_ops = &emu3_file_vm_ops;
+	return err;
+}
+
+//Direct reads take the inode lock so that they do not use clusters being moved by defragmentation.
+static ssize_t emu3_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	inode_lock_shared(inode);
+	ret = generic_file_read_iter(iocb, to);
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+//Clusters preallocated beyond the file size are kept until the last writer closes the file.
+int emu3_release_file(struct inode *inode, struct file *file)
+{
+	if ((file->f_mode & FMODE_WRITE)
+	    && atomic_read(&inode->i_writecount) == 1) {
+		inode_lock(inode);
+		emu3_truncate_clusters(inode);
+		inode_unlock(inode);
+		mark_inode_dirty(inode);
+	}
+	return 0;
 }
 
 static sector_t emu3_bmap(struct address_space *mapping, sector_t block)
@@ -111,9 +417,6 @@ static int emu3_setattr(struct dentry *dentry, struct iattr *attr)
 #endif
 {
 	struct inode *inode = d_inode(dentry);
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
-	struct emu3_inode *e3i = EMU3_I(inode);
-	blkcnt_t blocks;
 	int err;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
@@ -129,14 +432,22 @@ static int emu3_setattr(struct dentry *dentry, struct iattr *attr)
 		if (err)
 			return err;
 
-		truncate_setsize(inode, attr->ia_size);
-		mutex_lock(&info->lock);
-		emu3_set_fattrs(info, &e3i->data.fattrs, attr->ia_size);
-		emu3_prune_cluster_list(inode);
-		blocks = e3i->data.fattrs.clusters * info->blocks_per_cluster;
-		mutex_unlock(&info->lock);
+		//The stored size must not go beyond the allocated clusters.
+		//These are zeroed as they might hold data of removed files.
+		if (attr->ia_size > i_size_read(inode)) {
+			err = emu3_alloc_clusters(inode, (attr->ia_size - 1) >>
+						  EMU3_BSIZE_BITS);
+			if (!err)
+				err = emu3_zero_blocks(inode, i_size_read(inode),
+						       attr->ia_size);
+			if (err) {
+				emu3_truncate_clusters(inode);
+				return err;
+			}
+		}
 
-		inode->i_blocks = blocks;
+		truncate_setsize(inode, attr->ia_size);
+		emu3_truncate_clusters(inode);
 	}
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
 	setattr_copy(&init_user_ns, inode, attr);
@@ -150,22 +461,88 @@ static int emu3_setattr(struct dentry *dentry, struct iattr *attr)
 
 const struct address_space_operations emu3_aops = {
 	.readpage = emu3_readpage,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	.readahead = emu3_readahead,
+#else
+	.readpages = emu3_readpages,
+#endif
 	.writepage = emu3_writepage,
+	.writepages = emu3_writepages,
 	.write_begin = emu3_write_begin,
 	.write_end = generic_write_end,
 	.bmap = emu3_bmap,
+	.direct_IO = emu3_direct_IO,
 };
 
 const struct file_operations emu3_file_operations_file = {
 	.llseek = generic_file_llseek,
-	.read_iter = generic_file_read_iter,
+	.read_iter = emu3_file_read_iter,
 	.write_iter = generic_file_write_iter,
-	.mmap = generic_file_mmap,
+	.mmap = emu3_file_mmap,
 	.splice_read = generic_file_splice_read,
-	.fsync = generic_file_fsync
+	.fsync = generic_file_fsync,
+	.fallocate = emu3_fallocate,
+	.release = emu3_release_file,
+	.unlocked_ioctl = emu3_ioctl
 };
 
+//Reports the physically contiguous cluster runs of the file.
+static int emu3_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		       u64 start, u64 len)
+{
+	int err;
+	u32 flags;
+	struct emu3_extent e, next;
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	unsigned char shift = info->cluster_size_shift;
+	u64 data = (u64)info->start_data_block << EMU3_BSIZE_BITS;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	err = fiemap_prep(inode, fieinfo, start, &len, 0);
+#else
+	err = fiemap_check_flags(fieinfo, 0);
+#endif
+	if (err)
+		return err;
+
+	if (emu3_get_extent(inode, start >> shift, &e))
+		return 0;
+
+	while (((u64)e.start << shift) < start + len) {
+		flags = 0;
+		if (emu3_get_extent(inode, e.start + e.clusters, &next))
+			flags |= FIEMAP_EXTENT_LAST;
+
+		err = fiemap_fill_next_extent(fieinfo, (u64)e.start << shift,
+					      data +
+					      ((u64)(e.cluster - 1) << shift),
+					      (u64)e.clusters << shift, flags);
+		if (err)
+			return err < 0 ? err : 0;
+		if (flags & FIEMAP_EXTENT_LAST)
+			break;
+		e = next;
+	}
+
+	return 0;
+}
+
+void emu3_set_file_operations(struct inode *inode)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	if (emu3_test_opt(EMU3_SB(inode->i_sb), IOMAP)) {
+		inode->i_fop = &emu3_iomap_file_operations;
+		inode->i_mapping->a_ops = &emu3_iomap_aops;
+		mapping_set_large_folios(inode->i_mapping);
+		return;
+	}
+#endif
+	inode->i_fop = &emu3_file_operations_file;
+	inode->i_mapping->a_ops = &emu3_aops;
+}
+
 const struct inode_operations emu3_inode_operations_file = {
 	.listxattr = emu3_listxattr,
 	.setattr = emu3_setattr,
+	.fiemap = emu3_fiemap,
 };
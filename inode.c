@@ -30,10 +30,29 @@ inline void emu3_set_emu3_inode_data(struct inode *inode,
 	memcpy(&e3i->data, &e3d->data, sizeof(struct emu3_dentry_data));
 }
 
+//Removes the dentry to inode mapping of the given inode, if it is still the one mapped there.
+static inline void emu3_clear_d_map(struct emu3_sb_info *info,
+				    unsigned long ino)
+{
+	unsigned long *d;
+	unsigned int dnum = info->i_maps[ino - EMU3_I_ID_MAP_OFFSET];
+
+	if (!dnum)
+		return;
+
+	d = &info->d_maps[EMU3_DNUM_INDEX(info, dnum)];
+	if (*d == ino)
+		*d = 0;
+}
+
 inline void emu3_set_i_map(struct emu3_sb_info *info,
 			   struct inode *inode, unsigned int dnum)
 {
+	spin_lock(&info->i_maps_lock);
+	emu3_clear_d_map(info, inode->i_ino);
 	info->i_maps[inode->i_ino - EMU3_I_ID_MAP_OFFSET] = dnum;
+	info->d_maps[EMU3_DNUM_INDEX(info, dnum)] = inode->i_ino;
+	spin_unlock(&info->i_maps_lock);
 }
 
 inline unsigned int emu3_get_i_map(struct emu3_sb_info *info,
@@ -44,36 +63,82 @@ inline unsigned int emu3_get_i_map(struct emu3_sb_info *info,
 
 inline void emu3_clear_i_map(struct emu3_sb_info *info, struct inode *inode)
 {
+	spin_lock(&info->i_maps_lock);
+	emu3_clear_d_map(info, inode->i_ino);
 	info->i_maps[inode->i_ino - EMU3_I_ID_MAP_OFFSET] = 0;
+	__clear_bit(inode->i_ino - EMU3_I_ID_MAP_OFFSET, info->i_maps_bitmap);
+	spin_unlock(&info->i_maps_lock);
 }
 
-unsigned long emu3_get_or_add_i_map(struct emu3_sb_info *info,
-				    unsigned int dnum)
+//Inodes of removed files still open keep their number, so there might be none left. The inode maps lock must be held.
+static long emu3_take_ino(struct emu3_sb_info *info)
 {
-	int i, pos;
-	bool found;
-	unsigned int *empty;
-	unsigned int *v;
-
-	empty = NULL;
-	found = 0;
-	v = info->i_maps;
-	for (i = 0; i < EMU3_TOTAL_ENTRIES(info); i++, v++) {
-		if ((*v) == dnum) {
-			found = 1;
-			break;
-		}
+	unsigned long i = find_first_zero_bit(info->i_maps_bitmap,
+					      EMU3_TOTAL_ENTRIES(info));
 
-		if (!(*v) && !empty) {
-			empty = v;
-			pos = i;
+	if (i >= EMU3_TOTAL_ENTRIES(info))
+		return -ENOSPC;
+
+	__set_bit(i, info->i_maps_bitmap);
+	info->i_maps[i] = 0;
+	return i + EMU3_I_ID_MAP_OFFSET;
+}
+
+long emu3_get_or_add_i_map(struct emu3_sb_info *info, unsigned int dnum)
+{
+	long ino;
+	unsigned long *d = &info->d_maps[EMU3_DNUM_INDEX(info, dnum)];
+
+	spin_lock(&info->i_maps_lock);
+	ino = *d;
+	if (!ino) {
+		ino = emu3_take_ino(info);
+		if (ino > 0) {
+			info->i_maps[ino - EMU3_I_ID_MAP_OFFSET] = dnum;
+			*d = ino;
 		}
 	}
+	spin_unlock(&info->i_maps_lock);
 
-	if (!found)
-		*empty = dnum;
+	return ino;
+}
+
+//Takes an inode number for a dentry that is going to be added, so that adding it cannot fail afterwards.
+long emu3_reserve_i_map(struct emu3_sb_info *info)
+{
+	long ino;
 
-	return (found ? i : pos) + EMU3_I_ID_MAP_OFFSET;
+	spin_lock(&info->i_maps_lock);
+	ino = emu3_take_ino(info);
+	spin_unlock(&info->i_maps_lock);
+
+	return ino;
+}
+
+void emu3_cancel_i_map(struct emu3_sb_info *info, unsigned long ino)
+{
+	spin_lock(&info->i_maps_lock);
+	__clear_bit(ino - EMU3_I_ID_MAP_OFFSET, info->i_maps_bitmap);
+	spin_unlock(&info->i_maps_lock);
+}
+
+//Maps the dentry to the reserved inode number, unless a reader has already mapped it meanwhile.
+unsigned long emu3_add_i_map(struct emu3_sb_info *info, unsigned int dnum,
+			     unsigned long ino)
+{
+	unsigned long *d = &info->d_maps[EMU3_DNUM_INDEX(info, dnum)];
+
+	spin_lock(&info->i_maps_lock);
+	if (*d) {
+		__clear_bit(ino - EMU3_I_ID_MAP_OFFSET, info->i_maps_bitmap);
+		ino = *d;
+	} else {
+		info->i_maps[ino - EMU3_I_ID_MAP_OFFSET] = dnum;
+		*d = ino;
+	}
+	spin_unlock(&info->i_maps_lock);
+
+	return ino;
 }
 
 struct emu3_dentry *emu3_find_dentry_by_inode(struct inode *inode,
@@ -85,9 +150,13 @@ struct emu3_dentry *emu3_find_dentry_by_inode(struct inode *inode,
 	unsigned int blknum = EMU3_DNUM_BLKNUM(dnum);
 	unsigned int offset = EMU3_DNUM_OFFSET(dnum);
 
-	*b = sb_bread(inode->i_sb, blknum);
+	*b = emu3_bread(inode->i_sb, blknum);
+	if (!*b) {
+		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
+		return NULL;
+	}
 
-	e3d = (struct emu3_dentry *)(*b)->b_data;
+	e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(*b, blknum);
 	e3d += offset;
 
 	return e3d;
@@ -148,7 +217,7 @@ struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
 
 	inode = iget_locked(sb, ino);
 
-	if (IS_ERR(inode))
+	if (!inode)
 		return ERR_PTR(-ENOMEM);
 
 	if (!(inode->i_state & I_NEW))
@@ -164,8 +233,10 @@ struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
 	} else {
 		e3d = emu3_find_dentry_by_inode(inode, &b);
 
-		if (!e3d)
+		if (!e3d) {
+			iget_failed(inode);
 			return ERR_PTR(-EIO);
+		}
 
 		emu3_set_emu3_inode_data(inode, e3d);
 		brelse(b);
@@ -173,10 +244,10 @@ struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
 		if (EMU3_DENTRY_IS_FILE(e3d)) {
 			emu3_set_inode_size_file(inode);
 			iops = &emu3_inode_operations_file;
-			fops = &emu3_file_operations_file;
+			emu3_set_file_operations(inode);
+			fops = inode->i_fop;
 			links = 1;
 			mode = EMU3_FILE_MODE;
-			inode->i_mapping->a_ops = &emu3_aops;
 		} else if (EMU3_DENTRY_IS_DIR(e3d)) {
 			emu3_set_inode_size_dir(inode);
 			iops = &emu3_inode_operations_dir;
@@ -187,7 +258,7 @@ struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
 			printk(KERN_ERR
 			       "%s: entry is neither a file nor a directory\n",
 			       EMU3_MODULE_NAME);
-			brelse(b);
+			iget_failed(inode);
 			return ERR_PTR(-EIO);
 		}
 	}
@@ -0,0 +1,295 @@
+/*
+ *   iomap.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "emu3_fs.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+
+//Reports the whole contiguous run of clusters containing pos.
+//If delay is set, unmapped clusters are only reserved instead of allocated.
+static int __emu3_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+			      unsigned flags, struct iomap *iomap, bool delay)
+{
+	int err;
+	sector_t phys;
+	bool new = false;
+	sector_t block = pos >> EMU3_BSIZE_BITS;
+	sector_t last = (pos + length - 1) >> EMU3_BSIZE_BITS;
+	unsigned int blocks, max = last - block + 1;
+
+	blocks = emu3_get_phys_blocks(inode, block, max, &phys);
+	if (!blocks && (flags & IOMAP_WRITE) && delay) {
+		err = emu3_reserve_clusters(inode, last);
+		if (err)
+			return err;
+
+		iomap->bdev = inode->i_sb->s_bdev;
+		iomap->offset = (loff_t)block << EMU3_BSIZE_BITS;
+		iomap->flags = 0;
+		iomap->type = IOMAP_DELALLOC;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->length = (loff_t)max << EMU3_BSIZE_BITS;
+		return 0;
+	}
+
+	if (!blocks && (flags & IOMAP_WRITE)) {
+		err = emu3_alloc_clusters(inode, last);
+		if (err)
+			return err;
+		blocks = emu3_get_phys_blocks(inode, block, max, &phys);
+		if (!blocks)
+			return -ENOSPC;
+		new = true;
+	}
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)block << EMU3_BSIZE_BITS;
+	iomap->flags = 0;
+	if (blocks) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)phys << EMU3_BSIZE_BITS;
+		iomap->length = (loff_t)blocks << EMU3_BSIZE_BITS;
+		if (new)
+			iomap->flags |= IOMAP_F_NEW;
+	} else {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->length = (loff_t)max << EMU3_BSIZE_BITS;
+	}
+
+	return 0;
+}
+
+static int emu3_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+			    unsigned flags, struct iomap *iomap,
+			    struct iomap *srcmap)
+{
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+
+	//Buffered writes only reserve the clusters, which are allocated on writeback.
+	return __emu3_iomap_begin(inode, pos, length, flags, iomap,
+				  !(flags & IOMAP_DIRECT)
+				  && emu3_test_opt(info, DELALLOC));
+}
+
+const struct iomap_ops emu3_iomap_ops = {
+	.iomap_begin = emu3_iomap_begin,
+};
+
+//Delayed clusters up to the file size are allocated at once so they can be contiguous.
+static int emu3_map_blocks(struct iomap_writepage_ctx *wpc,
+			   struct inode *inode, loff_t offset)
+{
+	int err;
+	loff_t length = round_up(i_size_read(inode), EMU3_BSIZE) - offset;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length)
+		return 0;
+
+	err = emu3_alloc_delayed_clusters(inode);
+	if (err)
+		return err;
+
+	//Writeback cannot handle delayed mappings, so the clusters are always allocated.
+	return __emu3_iomap_begin(inode, offset, max_t(loff_t, length,
+						       EMU3_BSIZE),
+				  IOMAP_WRITE, &wpc->iomap, false);
+}
+
+static const struct iomap_writeback_ops emu3_writeback_ops = {
+	.map_blocks = emu3_map_blocks,
+};
+
+static int emu3_iomap_readpage(struct file *file, struct page *page)
+{
+	return iomap_readpage(page, &emu3_iomap_ops);
+}
+
+static void emu3_iomap_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &emu3_iomap_ops);
+}
+
+static int emu3_iomap_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	return iomap_writepage(page, wbc, &wpc, &emu3_writeback_ops);
+}
+
+static int emu3_iomap_writepages(struct address_space *mapping,
+				 struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	return iomap_writepages(mapping, wbc, &wpc, &emu3_writeback_ops);
+}
+
+static sector_t emu3_iomap_bmap(struct address_space *mapping, sector_t block)
+{
+	return iomap_bmap(mapping, block, &emu3_iomap_ops);
+}
+
+static int emu3_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+				 unsigned flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t end = iocb->ki_pos + size;
+
+	if (error)
+		return error;
+
+	if (end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static const struct iomap_dio_ops emu3_dio_ops = {
+	.end_io = emu3_dio_write_end_io,
+};
+
+static ssize_t emu3_iomap_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	size_t tail;
+	ssize_t ret = 0, read;
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (!(iocb->ki_flags & IOCB_DIRECT) || !iov_iter_count(to))
+		return generic_file_read_iter(iocb, to);
+
+	if (emu3_dio_align(iocb, to, &tail)) {
+		inode_lock_shared(inode);
+		ret = iomap_dio_rw(iocb, to, &emu3_iomap_ops, NULL, 0, 0);
+		inode_unlock_shared(inode);
+		iov_iter_reexpand(to, iov_iter_count(to) + tail);
+		if (ret < 0 || !iov_iter_count(to) ||
+		    iocb->ki_pos >= i_size_read(inode))
+			return ret;
+	}
+
+	//Unaligned tails are read through the page cache.
+	iocb->ki_flags &= ~IOCB_DIRECT;
+	read = generic_file_read_iter(iocb, to);
+	iocb->ki_flags |= IOCB_DIRECT;
+	if (read < 0)
+		return ret ? ret : read;
+	return ret + read;
+}
+
+//Unaligned tails are written through the page cache, which is written back and dropped afterwards.
+static ssize_t emu3_iomap_direct_write(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	int err;
+	size_t tail;
+	loff_t pos, end = iocb->ki_pos + iov_iter_count(from);
+	ssize_t ret, written = 0;
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	struct inode *inode = mapping->host;
+
+	if (emu3_dio_align(iocb, from, &tail)) {
+		written = iomap_dio_rw(iocb, from, &emu3_iomap_ops,
+				       &emu3_dio_ops, 0, 0);
+		iov_iter_reexpand(from, iov_iter_count(from) + tail);
+		if (written == -ENOTBLK)
+			written = 0;
+		//Clusters allocated beyond the end of the file are freed.
+		if (written < 0 && end > i_size_read(inode))
+			emu3_truncate_clusters(inode);
+		if (written < 0 || !iov_iter_count(from))
+			return written;
+	}
+
+	pos = iocb->ki_pos;
+	ret = iomap_file_buffered_write(iocb, from, &emu3_iomap_ops);
+	if (ret <= 0)
+		return written ? written : ret;
+	iocb->ki_pos += ret;
+
+	end = pos + ret - 1;
+	err = filemap_write_and_wait_range(mapping, pos, end);
+	if (err)
+		return written ? written : err;
+	invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT, end >> PAGE_SHIFT);
+
+	return written + ret;
+}
+
+static ssize_t emu3_iomap_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret;
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto end;
+
+	ret = file_modified(iocb->ki_filp);
+	if (ret)
+		goto end;
+
+	if (iocb->ki_flags & IOCB_DIRECT)
+		ret = emu3_iomap_direct_write(iocb, from);
+	else {
+		ret = iomap_file_buffered_write(iocb, from, &emu3_iomap_ops);
+		if (ret > 0)
+			iocb->ki_pos += ret;
+	}
+
+ end:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+const struct address_space_operations emu3_iomap_aops = {
+	.readpage = emu3_iomap_readpage,
+	.readahead = emu3_iomap_readahead,
+	.writepage = emu3_iomap_writepage,
+	.writepages = emu3_iomap_writepages,
+	.dirty_folio = filemap_dirty_folio,
+	.releasepage = iomap_releasepage,
+	.invalidate_folio = iomap_invalidate_folio,
+	.bmap = emu3_iomap_bmap,
+	.migratepage = iomap_migrate_page,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
+	.direct_IO = noop_direct_IO,
+};
+
+const struct file_operations emu3_iomap_file_operations = {
+	.llseek = generic_file_llseek,
+	.read_iter = emu3_iomap_read_iter,
+	.write_iter = emu3_iomap_write_iter,
+	.mmap = emu3_file_mmap,
+	.splice_read = generic_file_splice_read,
+	.fsync = generic_file_fsync,
+	.fallocate = emu3_fallocate,
+	.release = emu3_release_file,
+	.unlocked_ioctl = emu3_ioctl
+};
+
+#endif
@@ -27,8 +27,13 @@ static struct kmem_cache *emu3_inode_cachep;
 
 inline void emu3_free_dir_content_block(struct emu3_sb_info *info, int blknum)
 {
-	info->dir_content_block_list[blknum - info->start_dir_content_block] =
-	    0;
+	bool *b =
+	    &info->dir_content_block_list[blknum - info->start_dir_content_block];
+
+	if (*b) {
+		*b = 0;
+		info->free_dir_content_blocks++;
+	}
 }
 
 int emu3_get_free_dir_content_block(struct emu3_sb_info *info)
@@ -37,6 +42,7 @@ int emu3_get_free_dir_content_block(struct emu3_sb_info *info)
 	for (i = 0; i < info->dir_content_blocks; i++)
 		if (!info->dir_content_block_list[i]) {
 			info->dir_content_block_list[i] = 1;
+			info->free_dir_content_blocks--;
 			return info->start_dir_content_block + i;
 		}
 	return -1;
@@ -49,6 +55,11 @@ static struct inode *emu3_alloc_inode(struct super_block *sb)
 	e3i = kmem_cache_alloc(emu3_inode_cachep, GFP_KERNEL);
 	if (!e3i)
 		return NULL;
+	e3i->extents = NULL;
+	e3i->nr_extents = 0;
+	e3i->max_extents = 0;
+	e3i->reserved_clusters = 0;
+	e3i->dir_index = NULL;
 	return &e3i->vfs_inode;
 }
 
@@ -97,7 +108,7 @@ void emu3_init_fattrs(struct emu3_sb_info *info,
 	memset(fattrs->props, 0, EMU3_FILE_PROPS_LEN);
 }
 
-//Prunes the cluster list to the real inode size
+//Prunes the cluster list to the real inode size. The cluster list lock must be held for writing.
 void emu3_prune_cluster_list(struct inode *inode)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
@@ -106,19 +117,23 @@ void emu3_prune_cluster_list(struct inode *inode)
 	int pruning;
 
 	clusters = le16_to_cpu(e3i->data.fattrs.clusters);
-	last_cluster = emu3_get_cluster(inode, clusters - 1);
+	last_cluster = __emu3_get_cluster(inode, clusters - 1);
+	if (last_cluster < 0)
+		return;
 	pruning = 0;
 
-	next_cluster = le16_to_cpu(info->cluster_list[last_cluster]);
-	while (next_cluster != EMU_LAST_FILE_CLUSTER) {
-		info->cluster_list[last_cluster] =
-		    pruning ? 0 : cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+	next_cluster = emu3_get_next_cluster(info, last_cluster);
+	while (next_cluster > 0 && next_cluster != EMU_LAST_FILE_CLUSTER) {
+		emu3_set_cluster(info, last_cluster,
+				 pruning ? 0 : EMU_LAST_FILE_CLUSTER);
 		last_cluster = next_cluster;
-		next_cluster = le16_to_cpu(info->cluster_list[last_cluster]);
+		next_cluster = emu3_get_next_cluster(info, last_cluster);
 		pruning = 1;
 	}
-	if (pruning)
-		info->cluster_list[last_cluster] = 0;
+	if (pruning) {
+		emu3_set_cluster(info, last_cluster, 0);
+		emu3_truncate_extents(inode, clusters);
+	}
 }
 
 void emu3_set_inode_blocks(struct inode *inode, struct emu3_file_attrs *fattrs)
@@ -133,23 +148,39 @@ static int emu3_write_inode(struct inode *inode, struct writeback_control *wbc)
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	struct emu3_dentry *e3d;
 	struct buffer_head *bh;
+	unsigned short clusters;
 	int err = 0;
 
 	if (EMU3_IS_I_ROOT_DIR(inode) || EMU3_IS_I_REG_DIR(inode, info))
 		return 0;
 
-	mutex_lock(&info->lock);
+	//The stored size must not go beyond the allocated clusters.
+	err = emu3_alloc_delayed_clusters(inode);
+	if (err)
+		return err;
+
+	//Only this inode dentry is modified, so other readers are allowed.
+	down_read(&info->lock);
 
 	e3d = emu3_find_dentry_by_inode(inode, &bh);
 	if (!e3d) {
-		mutex_unlock(&info->lock);
+		up_read(&info->lock);
 		return -ENOENT;
 	}
 
+	down_write(&info->cluster_lock);
 	emu3_set_fattrs(info, &e3d->data.fattrs, inode->i_size);
-	emu3_set_inode_blocks(inode, &e3d->data.fattrs);
-	emu3_set_emu3_inode_data(inode, e3d);
-	emu3_prune_cluster_list(inode);
+	if (atomic_read(&inode->i_writecount)) {
+		//Preallocated clusters are pruned when the file is closed.
+		clusters = EMU3_I(inode)->data.fattrs.clusters;
+		emu3_set_emu3_inode_data(inode, e3d);
+		EMU3_I(inode)->data.fattrs.clusters = clusters;
+	} else {
+		emu3_set_inode_blocks(inode, &e3d->data.fattrs);
+		emu3_set_emu3_inode_data(inode, e3d);
+		emu3_prune_cluster_list(inode);
+	}
+	up_write(&info->cluster_lock);
 
 	mark_buffer_dirty(bh);
 	if (wbc->sync_mode == WB_SYNC_ALL) {
@@ -159,7 +190,7 @@ static int emu3_write_inode(struct inode *inode, struct writeback_control *wbc)
 	}
 
 	brelse(bh);
-	mutex_unlock(&info->lock);
+	up_read(&info->lock);
 	return err;
 }
 
@@ -191,6 +222,8 @@ static bool emu3_fix_first_dir_blocks(struct emu3_dentry *e3d,
 static void emu3_init_once(void *foo)
 {
 	struct emu3_inode *e3i = foo;
+	init_rwsem(&e3i->extents_lock);
+	init_rwsem(&e3i->mmap_lock);
 	inode_init_once(&e3i->vfs_inode);
 }
 
@@ -211,17 +244,6 @@ static void destroy_inodecache(void)
 	kmem_cache_destroy(emu3_inode_cachep);
 }
 
-static int emu3_get_free_clusters(struct emu3_sb_info *info)
-{
-	int free_clusters = 0;
-	int i;
-
-	for (i = 1; i <= info->clusters; i++)
-		if (!info->cluster_list[i])
-			free_clusters++;
-	return free_clusters;
-}
-
 static int emu3_get_free_inodes(struct super_block *sb)
 {
 	int i, j, blknum;
@@ -232,14 +254,14 @@ static int emu3_get_free_inodes(struct super_block *sb)
 
 	for (i = 0; i < info->root_blocks + info->dir_content_blocks; i++) {
 		blknum = info->start_root_block + i;
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
 			break;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
 		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++)
 			if (i < info->root_blocks) {
 				if (!EMU3_DENTRY_IS_DIR(e3d))
@@ -255,19 +277,6 @@ static int emu3_get_free_inodes(struct super_block *sb)
 	return free_inos;
 }
 
-static int emu3_get_free_dir_blocks(struct emu3_sb_info *info)
-{
-	bool *b;
-	int i, free_blks = 0;
-
-	b = info->dir_content_block_list;
-	for (i = 0; i < info->dir_content_blocks; i++, b++)
-		if (!*b)
-			free_blks++;
-
-	return free_blks;
-}
-
 static inline int emu3_get_addressable_blocks(struct emu3_sb_info *info)
 {
 	return info->root_blocks + info->dir_content_blocks +
@@ -279,6 +288,10 @@ static int emu3_statfs(struct dentry *dentry, struct kstatfs *buf)
 	struct super_block *sb = dentry->d_sb;
 	struct emu3_sb_info *info = EMU3_SB(sb);
 	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+	int err = emu3_wait_cluster_list_scan(info);
+
+	if (err)
+		return err;
 
 	//For the free space and free inodes we do not consider files.
 	buf->f_type = EMU3_FS_TYPE;
@@ -286,84 +299,465 @@ static int emu3_statfs(struct dentry *dentry, struct kstatfs *buf)
 	//Total addressable blocks.
 	buf->f_blocks = emu3_get_addressable_blocks(info);
 	buf->f_bfree =
-	    emu3_get_free_clusters(info) * info->blocks_per_cluster +
-	    emu3_get_free_dir_blocks(info);
+	    (info->free_clusters - info->reserved_clusters) *
+	    info->blocks_per_cluster +
+	    info->free_dir_content_blocks;
 	buf->f_bavail = buf->f_bfree;
 	buf->f_files = EMU3_ENTRIES_PER_BLOCK * (info->root_blocks +
 						 info->dir_content_blocks);
-	buf->f_ffree = emu3_get_free_inodes(sb);
+	buf->f_ffree = info->free_inodes;
 	buf->f_fsid.val[0] = (u32) id;
 	buf->f_fsid.val[1] = (u32) (id >> 32);
 	buf->f_namelen = EMU3_LENGTH_FILENAME;
 	return 0;
 }
 
-//Base 0 search
-int emu3_get_cluster(struct inode *inode, int n)
+//The cluster list lock must be held for writing.
+void emu3_clear_cluster_list(struct inode *inode)
 {
+	int i = 1;
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
-	short next = EMU3_I_START_CLUSTER(inode);
-	int i = 0;
-
-	while (i < n) {
-		if (le16_to_cpu(info->cluster_list[next]) ==
-		    EMU_LAST_FILE_CLUSTER)
-			return -1;
-		next = le16_to_cpu(info->cluster_list[next]);
+	short prev, next = EMU3_I_START_CLUSTER(inode);
+
+	while (emu3_get_next_cluster(info, next) != EMU_LAST_FILE_CLUSTER) {
+		prev = next;
+		next = emu3_get_next_cluster(info, next);
+		if (next < 1 || next > info->clusters) {
+			printk(KERN_CRIT "%s: Bad cluster %d in inode %ld\n",
+			       EMU3_MODULE_NAME, next, inode->i_ino);
+			next = prev;
+			break;
+		}
+		emu3_set_cluster(info, prev, 0);
 		i++;
+		if (i > info->clusters) {
+			printk(KERN_CRIT "%s: Loop detected in cluster list\n",
+			       EMU3_MODULE_NAME);
+			break;
+		}
 	}
-	return next;
+	emu3_set_cluster(info, next, 0);
 }
 
-void emu3_init_cluster_list(struct inode *inode)
+//Reads the blocks of a cluster list page. Concurrent readers hold the cluster list lock for reading, so the first one to finish installs the page.
+static short *emu3_load_cluster_page(struct emu3_sb_info *info, unsigned int n)
 {
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	int i, blknum;
+	short *page, *old;
+	struct buffer_head *b;
+
+	page = (short *)get_zeroed_page(GFP_NOFS);
+	if (!page)
+		return ERR_PTR(-ENOMEM);
 
-	info->cluster_list[EMU3_I_START_CLUSTER(inode)] =
-	    cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+	for (i = 0; i < EMU3_CLUSTER_BLOCKS_PER_PAGE; i++) {
+		if (n * EMU3_CLUSTER_BLOCKS_PER_PAGE + i >=
+		    info->cluster_list_blocks)
+			break;
+
+		blknum = info->start_cluster_list_block +
+		    n * EMU3_CLUSTER_BLOCKS_PER_PAGE + i;
+		b = emu3_bread(info->sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			free_page((unsigned long)page);
+			return ERR_PTR(-EIO);
+		}
+		memcpy(&page[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i],
+		       EMU3_BLOCK_DATA(b, blknum),
+		       EMU3_BSIZE);
+		brelse(b);
+	}
+
+	old = cmpxchg(&info->cluster_pages[n], NULL, page);
+	if (old) {
+		free_page((unsigned long)page);
+		return old;
+	}
+	return page;
 }
 
-static void emu3_clear_cluster_list(struct inode *inode)
+//The cluster list lock must be held.
+static short *emu3_get_cluster_entry(struct emu3_sb_info *info, short cluster)
 {
-	int i = 1;
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
-	short prev, next = EMU3_I_START_CLUSTER(inode);
+	short *page;
+	unsigned int n = cluster / EMU3_CLUSTER_ENTRIES_PER_PAGE;
 
-	while (le16_to_cpu(info->cluster_list[next]) != EMU_LAST_FILE_CLUSTER) {
-		prev = next;
-		next = le16_to_cpu(info->cluster_list[next]);
-		info->cluster_list[prev] = 0;
-		i++;
-		if (i > info->clusters) {
-			printk(KERN_CRIT "%s: Loop detected in cluster list\n",
-			       EMU3_MODULE_NAME);
+	if (cluster < 0 || n >= EMU3_CLUSTER_PAGES(info))
+		return ERR_PTR(-EIO);
+
+	page = READ_ONCE(info->cluster_pages[n]);
+	if (!page) {
+		page = emu3_load_cluster_page(info, n);
+		if (IS_ERR(page))
+			return page;
+	}
+	return &page[cluster % EMU3_CLUSTER_ENTRIES_PER_PAGE];
+}
+
+//Returns the next cluster in the list or a negative error. The cluster list lock must be held.
+short emu3_get_next_cluster(struct emu3_sb_info *info, short cluster)
+{
+	short *entry = emu3_get_cluster_entry(info, cluster);
+
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+	return le16_to_cpu(*entry);
+}
+
+//The cluster list lock must be held for writing.
+int emu3_set_cluster(struct emu3_sb_info *info, short cluster, short next)
+{
+	short *entry = emu3_get_cluster_entry(info, cluster);
+
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+
+	if (*entry != cpu_to_le16(next)) {
+		*entry = cpu_to_le16(next);
+		__set_bit(cluster / EMU3_CLUSTER_ENTRIES_PER_BLOCK,
+			  info->cluster_list_dirty);
+	}
+	//The clusters not scanned yet are counted when they are.
+	if (next) {
+		if (cluster < info->scanned_clusters
+		    && !__test_and_set_bit(cluster, info->cluster_bitmap))
+			info->free_clusters--;
+		if (info->discard_bitmap)
+			__clear_bit(cluster, info->discard_bitmap);
+	} else {
+		if (cluster < info->scanned_clusters
+		    && __test_and_clear_bit(cluster, info->cluster_bitmap))
+			info->free_clusters++;
+		if (info->discard_bitmap)
+			__set_bit(cluster, info->discard_bitmap);
+	}
+	return 0;
+}
+
+//Adds the clusters of a cluster list page to the bitmap and the free clusters. The cluster list lock must be held for writing.
+//A loaded page is used as it may have been modified. Otherwise, its blocks are read without keeping the page.
+static int emu3_scan_cluster_page(struct emu3_sb_info *info, unsigned int n)
+{
+	int i, j, index, blknum, cluster;
+	short *entries, *page = NULL;
+	struct buffer_head *b;
+
+	if (n < EMU3_CLUSTER_PAGES(info))
+		page = info->cluster_pages[n];
+
+	for (i = 0; i < EMU3_CLUSTER_BLOCKS_PER_PAGE; i++) {
+		index = n * EMU3_CLUSTER_BLOCKS_PER_PAGE + i;
+		cluster = EMU3_CLUSTER_ENTRIES_PER_BLOCK * index;
+		if (index >= info->cluster_list_blocks
+		    || cluster > info->clusters)
 			break;
+
+		b = NULL;
+		if (page)
+			entries = &page[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i];
+		else {
+			blknum = info->start_cluster_list_block + index;
+			b = emu3_bread(info->sb, blknum);
+			if (!b) {
+				printk(KERN_CRIT EMU3_ERR_NOT_BLK,
+				       EMU3_MODULE_NAME, blknum);
+				return -EIO;
+			}
+			entries = (short *)EMU3_BLOCK_DATA(b, blknum);
+		}
+
+		for (j = 0; j < EMU3_CLUSTER_ENTRIES_PER_BLOCK; j++, cluster++) {
+			if (cluster < 1 || cluster > info->clusters)
+				continue;
+			if (entries[j])
+				__set_bit(cluster, info->cluster_bitmap);
+			else
+				info->free_clusters++;
 		}
+		brelse(b);
 	}
-	info->cluster_list[next] = 0;
+	WRITE_ONCE(info->scanned_clusters,
+		   (n + 1) * EMU3_CLUSTER_ENTRIES_PER_PAGE);
+
+	return 0;
 }
 
+//Finishes the scan of the cluster list, which is needed to allocate clusters. The cluster list lock must be held for writing.
+int emu3_scan_cluster_list(struct emu3_sb_info *info)
+{
+	int err;
+
+	while (info->scanned_clusters <= info->clusters) {
+		err = emu3_scan_cluster_page(info, info->scanned_clusters /
+					     EMU3_CLUSTER_ENTRIES_PER_PAGE);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int emu3_wait_cluster_list_scan(struct emu3_sb_info *info)
+{
+	int err;
+
+	if (READ_ONCE(info->scanned_clusters) > info->clusters)
+		return 0;
+
+	down_write(&info->cluster_lock);
+	err = emu3_scan_cluster_list(info);
+	up_write(&info->cluster_lock);
+	return err;
+}
+
+//Next fit search starting after the last allocated cluster. The cluster list lock must be held for writing.
 int emu3_next_free_cluster(struct emu3_sb_info *info)
 {
-	int i;
+	unsigned long i;
+
+	i = find_next_zero_bit(info->cluster_bitmap, info->clusters,
+			       info->next_free_cluster);
+	if (i >= info->clusters)
+		i = find_next_zero_bit(info->cluster_bitmap, info->clusters, 1);
+	if (i >= info->clusters)
+		return -ENOSPC;
+
+	info->next_free_cluster = i + 1;
+	return i;
+}
+
+//First free run of count clusters from the given cluster. The cluster list lock must be held.
+unsigned long emu3_find_free_run(struct emu3_sb_info *info,
+				 unsigned long from, int count)
+{
+	unsigned long start, end;
+
+	start = find_next_zero_bit(info->cluster_bitmap, info->clusters, from);
+	while (start < info->clusters) {
+		end = find_next_bit(info->cluster_bitmap, info->clusters, start);
+		if (end - start >= count)
+			return start;
+		start = find_next_zero_bit(info->cluster_bitmap,
+					   info->clusters, end);
+	}
+	return info->clusters;
+}
+
+//Prefers the goal cluster, so that files grow contiguously, and then the first free run of count clusters.
+//The cluster list lock must be held for writing.
+int emu3_find_free_cluster(struct emu3_sb_info *info, int goal, int count)
+{
+	unsigned long i;
+
+	if (goal > 0 && goal < info->clusters
+	    && !test_bit(goal, info->cluster_bitmap)) {
+		info->next_free_cluster = goal + 1;
+		return goal;
+	}
+
+	i = emu3_find_free_run(info, info->next_free_cluster, count);
+	if (i >= info->clusters)
+		i = emu3_find_free_run(info, 1, count);
+	if (i >= info->clusters)
+		return emu3_next_free_cluster(info);
+
+	info->next_free_cluster = i + 1;
+	return i;
+}
+
+static inline bool emu3_bdev_discard(struct block_device *bdev)
+{
+	return blk_queue_discard(bdev_get_queue(bdev));
+}
+
+static int emu3_discard_clusters(struct super_block *sb, unsigned long start,
+				 unsigned long clusters)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	unsigned int shift = EMU3_BLOCK_SHIFT(sb);
 
-	for (i = 1; i < info->clusters; i++)
-		if (info->cluster_list[i] == 0)
-			return i;
-	return -ENOSPC;
+	return sb_issue_discard(sb, (info->start_data_block +
+				     (start - 1) * info->blocks_per_cluster) >>
+				shift,
+				(clusters * info->blocks_per_cluster) >> shift,
+				GFP_NOFS, 0);
 }
 
-sector_t emu3_get_phys_block(struct inode *inode, sector_t block)
+//Takes the clusters freed since the last call, which are marked as used until emu3_discard_freed so that they are not reused meanwhile.
+//The cluster list lock must be held for writing.
+static void emu3_take_freed(struct emu3_sb_info *info, unsigned long *freed)
 {
+	bitmap_copy(freed, info->discard_bitmap, info->clusters + 1);
+	bitmap_zero(info->discard_bitmap, info->clusters + 1);
+	bitmap_or(info->cluster_bitmap, info->cluster_bitmap, freed,
+		  info->clusters + 1);
+}
+
+//Discards the clusters taken with emu3_take_freed, without the cluster list lock, and releases them.
+//If discard is not set, they are left to be discarded the next time.
+static int emu3_discard_freed(struct super_block *sb, unsigned long *freed,
+			      bool discard)
+{
+	int err = 0;
+	unsigned long start, end;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	start = find_next_bit(freed, info->clusters + 1, 1);
+	while (discard && start <= info->clusters) {
+		end = find_next_zero_bit(freed, info->clusters + 1, start);
+		if (!err)
+			err = emu3_discard_clusters(sb, start, end - start);
+		start = find_next_bit(freed, info->clusters + 1, end);
+	}
+
+	down_write(&info->cluster_lock);
+	bitmap_andnot(info->cluster_bitmap, info->cluster_bitmap, freed,
+		      info->clusters + 1);
+	if (!discard)
+		bitmap_or(info->discard_bitmap, info->discard_bitmap, freed,
+			  info->clusters + 1);
+	up_write(&info->cluster_lock);
+
+	return err == -EOPNOTSUPP ? 0 : err;
+}
+
+//Discards the free runs in the range, one at a time. Each run is marked as used while it is discarded so that allocations are not blocked meanwhile.
+//Clusters freed since the last sync are skipped, as the metadata on disk may still use them.
+int emu3_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	int err = 0;
+	bool discard;
+	unsigned long start, end, last, cluster_bytes, trimmed = 0;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	u64 data_start = (u64)info->start_data_block << EMU3_BSIZE_BITS;
+	u64 range_end = range->len > U64_MAX - range->start ?
+	    U64_MAX : range->start + range->len;
+
+	if (!emu3_bdev_discard(sb->s_bdev))
+		return -EOPNOTSUPP;
+
+	cluster_bytes = 1UL << info->cluster_size_shift;
+	if (range->len < cluster_bytes || range_end <= data_start) {
+		range->len = 0;
+		return 0;
+	}
+
+	start = range->start > data_start ?
+	    div64_u64(range->start - data_start, cluster_bytes) + 1 : 1;
+	last = min_t(u64, div64_u64(range_end - data_start, cluster_bytes),
+		     info->clusters);
+
+	err = emu3_wait_cluster_list_scan(info);
+	if (err)
+		return err;
+
+	while (start <= last) {
+		down_write(&info->cluster_lock);
+		start = find_next_zero_bit(info->cluster_bitmap, last + 1,
+					   start);
+		if (start <= last && info->discard_bitmap
+		    && test_bit(start, info->discard_bitmap)) {
+			start = find_next_zero_bit(info->discard_bitmap,
+						   last + 1, start);
+			up_write(&info->cluster_lock);
+			continue;
+		}
+		if (start > last) {
+			up_write(&info->cluster_lock);
+			break;
+		}
+		end = find_next_bit(info->cluster_bitmap, last + 1, start);
+		if (info->discard_bitmap)
+			end = find_next_bit(info->discard_bitmap, end, start);
+		discard = (end - start) * cluster_bytes >= range->minlen;
+		if (discard)
+			bitmap_set(info->cluster_bitmap, start, end - start);
+		up_write(&info->cluster_lock);
+
+		if (discard) {
+			err = emu3_discard_clusters(sb, start, end - start);
+			down_write(&info->cluster_lock);
+			bitmap_clear(info->cluster_bitmap, start, end - start);
+			up_write(&info->cluster_lock);
+			if (err)
+				break;
+			trimmed += end - start;
+		}
+		start = end;
+
+		if (fatal_signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+
+	range->len = (u64)trimmed * cluster_bytes;
+	return err;
+}
+
+//Reserves the clusters needed to write up to block without allocating them.
+int emu3_reserve_clusters(struct inode *inode, sector_t block)
+{
+	int err = 0;
+	unsigned int needed, have;
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	needed = ((unsigned int)block) / info->blocks_per_cluster + 1;
+	have = READ_ONCE(e3i->data.fattrs.clusters) +
+	    READ_ONCE(e3i->reserved_clusters);
+	if (needed <= have)
+		return 0;
+
+	down_write(&info->cluster_lock);
+	err = emu3_scan_cluster_list(info);
+	have = e3i->data.fattrs.clusters + e3i->reserved_clusters;
+	if (!err && needed > have) {
+		needed -= have;
+		if (info->free_clusters < info->reserved_clusters + needed)
+			err = -ENOSPC;
+		else {
+			info->reserved_clusters += needed;
+			e3i->reserved_clusters += needed;
+		}
+	}
+	up_write(&info->cluster_lock);
+
+	return err;
+}
+
+//Releases up to clusters reserved clusters. The cluster list lock must be held for writing.
+void emu3_release_clusters(struct inode *inode, unsigned int clusters)
+{
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	clusters = min(clusters, e3i->reserved_clusters);
+	e3i->reserved_clusters -= clusters;
+	info->reserved_clusters -= clusters;
+}
+
+//Returns the amount of physically contiguous blocks, up to max, mapped from block or 0 if not mapped.
+unsigned int emu3_get_phys_blocks(struct inode *inode, sector_t block,
+				  unsigned int max, sector_t *phys)
+{
+	struct emu3_extent e;
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	int cluster = ((int)block) / info->blocks_per_cluster;
 	int offset = ((int)block) % info->blocks_per_cluster;
+	unsigned int blocks;
+
+	if (emu3_get_extent(inode, cluster, &e))
+		return 0;
 
-	cluster = emu3_get_cluster(inode, cluster);
-	if (cluster == -1)
-		return -1;
-	return info->start_data_block +
-	    ((cluster - 1) * info->blocks_per_cluster) + offset;
+	*phys = info->start_data_block +
+	    ((e.cluster + cluster - e.start - 1) * info->blocks_per_cluster) +
+	    offset;
+	blocks = (e.start + e.clusters - cluster) * info->blocks_per_cluster -
+	    offset;
+	return min(blocks, max);
 }
 
 static void emu3_evict_inode(struct inode *inode)
@@ -371,33 +765,42 @@ static void emu3_evict_inode(struct inode *inode)
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	truncate_inode_pages(&inode->i_data, 0);
 	if (!inode->i_nlink && inode->i_mode & S_IFREG) {
-		mutex_lock(&info->lock);
 		emu3_clear_i_map(info, inode);
+		down_write(&info->cluster_lock);
 		emu3_clear_cluster_list(inode);
-		mutex_unlock(&info->lock);
+		emu3_release_clusters(inode, UINT_MAX);
+		up_write(&info->cluster_lock);
 		inode->i_size = 0;
 	}
+	emu3_free_extents(inode);
+	emu3_free_dir_index(inode);
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
 }
 
+//Only the modified blocks are written. The cluster list lock must be held.
 static int emu3_write_cluster_list(struct super_block *sb)
 {
 	struct emu3_sb_info *info = EMU3_SB(sb);
 	struct buffer_head *b;
 	int i, blknum;
+	short *page;
 
-	for (i = 0; i < info->cluster_list_blocks; i++) {
+	for_each_set_bit(i, info->cluster_list_dirty, info->cluster_list_blocks) {
+		//Only the loaded pages can be modified.
+		page = info->cluster_pages[i / EMU3_CLUSTER_BLOCKS_PER_PAGE];
+		clear_bit(i, info->cluster_list_dirty);
 		blknum = info->start_cluster_list_block + i;
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
+			set_bit(i, info->cluster_list_dirty);
 			return -EIO;
 		}
 
-		memcpy(b->b_data,
-		       &info->cluster_list[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i],
+		memcpy(EMU3_BLOCK_DATA(b, blknum), &page[EMU3_CLUSTER_ENTRIES_PER_BLOCK *
+					(i % EMU3_CLUSTER_BLOCKS_PER_PAGE)],
 		       EMU3_BSIZE);
 		mark_buffer_dirty(b);
 		brelse(b);
@@ -406,27 +809,117 @@ static int emu3_write_cluster_list(struct super_block *sb)
 	return 0;
 }
 
-static int emu3_read_cluster_list(struct super_block *sb)
+//Reads ahead a range of blocks. Under a plug, the requests are merged into a few large reads.
+static void emu3_prefetch_blocks(struct super_block *sb, unsigned int start,
+				 unsigned int blocks)
 {
+	sector_t i;
+	unsigned int shift = EMU3_BLOCK_SHIFT(sb);
+
+	if (!blocks)
+		return;
+
+	for (i = start >> shift; i <= (start + blocks - 1) >> shift; i++)
+		sb_breadahead(sb, i);
+}
+
+//The metadata is contiguous, so it is requested at once before it is read block by block.
+static void emu3_prefetch_metadata(struct super_block *sb)
+{
+	struct blk_plug plug;
 	struct emu3_sb_info *info = EMU3_SB(sb);
-	struct buffer_head *b;
-	int i, blknum;
 
-	for (i = 0; i < info->cluster_list_blocks; i++) {
-		blknum = info->start_cluster_list_block + i;
-		b = sb_bread(sb, blknum);
-		if (!b) {
-			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
-			       blknum);
-			return -EIO;
-		}
+	blk_start_plug(&plug);
+	emu3_prefetch_blocks(sb, info->start_root_block, info->root_blocks);
+	emu3_prefetch_blocks(sb, info->start_dir_content_block,
+			     info->dir_content_blocks);
+	blk_finish_plug(&plug);
+}
 
-		memcpy(&info->cluster_list[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i],
-		       b->b_data, EMU3_BSIZE);
-		brelse(b);
+static void emu3_free_cluster_pages(struct emu3_sb_info *info)
+{
+	int i;
+
+	if (!info->cluster_pages)
+		return;
+
+	for (i = 0; i < EMU3_CLUSTER_PAGES(info); i++)
+		free_page((unsigned long)info->cluster_pages[i]);
+	kfree(info->cluster_pages);
+}
+
+//Freed clusters are only discarded when waiting and once the metadata not using them any more is on disk.
+static int emu3_sync_fs(struct super_block *sb, int wait)
+{
+	int err, derr;
+	unsigned long *freed = NULL;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	if (wait && info->discard_bitmap)
+		freed = kmalloc(sizeof(unsigned long) *
+				BITS_TO_LONGS(info->clusters + 1), GFP_NOFS);
+
+	if (!freed) {
+		down_read(&info->cluster_lock);
+		err = emu3_write_cluster_list(sb);
+		up_read(&info->cluster_lock);
+		return err;
 	}
 
-	return 0;
+	//The dentries are updated under the lock, so those of the freed clusters are already dirty.
+	down_write(&info->lock);
+	down_write(&info->cluster_lock);
+	err = emu3_write_cluster_list(sb);
+	emu3_take_freed(info, freed);
+	up_write(&info->cluster_lock);
+	up_write(&info->lock);
+
+	if (!err)
+		err = sync_blockdev(sb->s_bdev);
+	derr = emu3_discard_freed(sb, freed, !err);
+	kfree(freed);
+
+	return err ? err : derr;
+}
+
+//Scans the cluster list after mounting a page at a time, so that the cluster list is not locked for long.
+static void emu3_scan_work(struct work_struct *work)
+{
+	int err = 0;
+	struct emu3_sb_info *info = container_of(work, struct emu3_sb_info,
+						 scan_work);
+
+	emu3_prefetch_blocks(info->sb, info->start_cluster_list_block,
+			     info->cluster_list_blocks);
+
+	while (!err) {
+		down_write(&info->cluster_lock);
+		if (info->scanned_clusters > info->clusters) {
+			up_write(&info->cluster_lock);
+			break;
+		}
+		err = emu3_scan_cluster_page(info, info->scanned_clusters /
+					     EMU3_CLUSTER_ENTRIES_PER_PAGE);
+		up_write(&info->cluster_lock);
+		cond_resched();
+	}
+}
+
+//Writes the cluster list and every dirty metadata block every commit interval.
+static void emu3_commit(struct work_struct *work)
+{
+	struct blk_plug plug;
+	struct emu3_sb_info *info = container_of(to_delayed_work(work),
+						 struct emu3_sb_info,
+						 commit_work);
+	struct super_block *sb = info->sb;
+
+	blk_start_plug(&plug);
+	emu3_sync_fs(sb, 1);
+	sync_blockdev(sb->s_bdev);
+	blk_finish_plug(&plug);
+
+	schedule_delayed_work(&info->commit_work, info->commit_interval * HZ);
 }
 
 static void emu3_put_super(struct super_block *sb)
@@ -434,27 +927,113 @@ static void emu3_put_super(struct super_block *sb)
 	struct emu3_sb_info *info = EMU3_SB(sb);
 
 	if (info) {
-		mutex_lock(&info->lock);
-		emu3_write_cluster_list(sb);
-		mutex_unlock(&info->lock);
+		cancel_delayed_work_sync(&info->commit_work);
+		cancel_work_sync(&info->scan_work);
+		emu3_debugfs_unregister(sb);
 
-		mutex_destroy(&info->lock);
+		down_read(&info->cluster_lock);
+		emu3_write_cluster_list(sb);
+		up_read(&info->cluster_lock);
 
-		kfree(info->cluster_list);
+		emu3_free_cluster_pages(info);
+		kfree(info->cluster_bitmap);
+		kfree(info->cluster_list_dirty);
+		kfree(info->discard_bitmap);
 		kfree(info->dir_content_block_list);
 		kfree(info->i_maps);
+		kfree(info->i_maps_bitmap);
+		kfree(info->d_maps);
 		kfree(info);
 		sb->s_fs_info = NULL;
 	}
 }
 
+static int emu3_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct emu3_sb_info *info = EMU3_SB(root->d_sb);
+
+	if (emu3_test_opt(info, IOMAP))
+		seq_puts(seq, ",iomap");
+	if (emu3_test_opt(info, DELALLOC))
+		seq_puts(seq, ",delalloc");
+	if (emu3_test_opt(info, DISCARD))
+		seq_puts(seq, ",discard");
+	if (info->commit_interval)
+		seq_printf(seq, ",commit=%u", info->commit_interval);
+	return 0;
+}
+
+enum {
+	Opt_iomap, Opt_delalloc, Opt_commit, Opt_discard, Opt_err
+};
+
+static const match_table_t emu3_tokens = {
+	{Opt_iomap, "iomap"},
+	{Opt_delalloc, "delalloc"},
+	{Opt_commit, "commit=%u"},
+	{Opt_discard, "discard"},
+	{Opt_err, NULL}
+};
+
+static int emu3_parse_options(char *options, struct emu3_sb_info *info)
+{
+	char *p;
+	int token, option;
+	substring_t args[MAX_OPT_ARGS];
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		token = match_token(p, emu3_tokens, args);
+		switch (token) {
+		case Opt_iomap:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+			emu3_set_opt(info, IOMAP);
+			break;
+#else
+			printk(KERN_ERR
+			       "%s: iomap option not supported by this kernel\n",
+			       EMU3_MODULE_NAME);
+			return -EINVAL;
+#endif
+		case Opt_delalloc:
+			emu3_set_opt(info, DELALLOC);
+			break;
+		case Opt_commit:
+			if (match_int(&args[0], &option) || option < 0) {
+				printk(KERN_ERR
+				       "%s: invalid commit interval '%s'\n",
+				       EMU3_MODULE_NAME, p);
+				return -EINVAL;
+			}
+			info->commit_interval = option;
+			break;
+		case Opt_discard:
+			emu3_set_opt(info, DISCARD);
+			break;
+		default:
+			printk(KERN_ERR "%s: unrecognized mount option '%s'\n",
+			       EMU3_MODULE_NAME, p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 static const struct super_operations emu3_super_operations = {
 	.alloc_inode = emu3_alloc_inode,
 	.destroy_inode = emu3_destroy_inode,
 	.write_inode = emu3_write_inode,
 	.evict_inode = emu3_evict_inode,
 	.put_super = emu3_put_super,
-	.statfs = emu3_statfs
+	.sync_fs = emu3_sync_fs,
+	.statfs = emu3_statfs,
+	.show_options = emu3_show_options
 };
 
 static int emu3_fill_super(struct super_block *sb, void *data,
@@ -469,12 +1048,14 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	short *block, index;
 	struct emu3_dentry *e3d;
 	unsigned int *parameters;
-	unsigned int root_ino;
+	long root_ino;
 
-	if (sb_set_blocksize(sb, EMU3_BSIZE) != EMU3_BSIZE) {
+	//Devices with bigger logical blocks, like CD drives, are used with their own block size.
+	size = max_t(int, bdev_logical_block_size(sb->s_bdev), EMU3_BSIZE);
+	if (!sb_set_blocksize(sb, size)) {
 		printk(KERN_ERR
-		       "%s: 512B block size not allowed on this device\n",
-		       EMU3_MODULE_NAME);
+		       "%s: %dB block size not allowed on this device\n",
+		       EMU3_MODULE_NAME, size);
 		return -EINVAL;
 	}
 
@@ -483,6 +1064,20 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 		return -ENOMEM;
 
 	sb->s_fs_info = info;
+	info->sb = sb;
+	INIT_DELAYED_WORK(&info->commit_work, emu3_commit);
+	INIT_WORK(&info->scan_work, emu3_scan_work);
+
+	err = emu3_parse_options(data, info);
+	if (err)
+		goto out1;
+
+	if (emu3_test_opt(info, DISCARD) && !emu3_bdev_discard(sb->s_bdev)) {
+		printk(KERN_WARNING
+		       "%s: discard not supported by the device, option ignored\n",
+		       EMU3_MODULE_NAME);
+		emu3_clear_opt(info, DISCARD);
+	}
 
 	sbh = sb_bread(sb, 0);
 	if (!sbh) {
@@ -520,16 +1115,58 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	//This is not a problem on RO disks.
 	info->clusters = le32_to_cpu(parameters[9]);
 
+	//Metadata blocks are updated inside the device blocks but file data is mapped in device blocks.
+	if ((info->start_data_block | info->blocks_per_cluster) &
+	    ((1 << EMU3_BLOCK_SHIFT(sb)) - 1)) {
+		printk(KERN_ERR
+		       "%s: clusters not aligned to the %luB device blocks\n",
+		       EMU3_MODULE_NAME, sb->s_blocksize);
+		err = -EINVAL;
+		goto out2;
+	}
+
+	//The inode maps are indexed from the root blocks up to the end of the dir content blocks.
+	if (info->start_dir_content_block !=
+	    info->start_root_block + info->root_blocks) {
+		printk(KERN_ERR
+		       "%s: dir content blocks not following the root blocks\n",
+		       EMU3_MODULE_NAME);
+		err = -EINVAL;
+		goto out2;
+	}
+
 	//Now it's time to read the cluster list...
-	size = EMU3_BSIZE * info->cluster_list_blocks;
-	info->cluster_list = kzalloc(size, GFP_KERNEL);
-	if (!info->cluster_list) {
+	size = sizeof(short *) * EMU3_CLUSTER_PAGES(info);
+	info->cluster_pages = kzalloc(size, GFP_KERNEL);
+	if (!info->cluster_pages) {
 		err = -ENOMEM;
 		goto out2;
 	}
-	err = emu3_read_cluster_list(sb);
-	if (err)
+	size = sizeof(unsigned long) * BITS_TO_LONGS(info->clusters + 1);
+	info->cluster_bitmap = kzalloc(size, GFP_KERNEL);
+	if (!info->cluster_bitmap) {
+		err = -ENOMEM;
 		goto out3;
+	}
+	size = sizeof(unsigned long) * BITS_TO_LONGS(info->cluster_list_blocks);
+	info->cluster_list_dirty = kzalloc(size, GFP_KERNEL);
+	if (!info->cluster_list_dirty) {
+		err = -ENOMEM;
+		goto out3;
+	}
+	if (emu3_test_opt(info, DISCARD)) {
+		size = sizeof(unsigned long) *
+		    BITS_TO_LONGS(info->clusters + 1);
+		info->discard_bitmap = kzalloc(size, GFP_KERNEL);
+		if (!info->discard_bitmap) {
+			err = -ENOMEM;
+			goto out3;
+		}
+	}
+	//Cluster 0 is not used.
+	__set_bit(0, info->cluster_bitmap);
+	info->next_free_cluster = 1;
+	emu3_prefetch_metadata(sb);
 
 	printk(KERN_INFO
 	       "%s: %d physical blocks, %d addressable blocks, %d clusters, %d blocks/cluster\n",
@@ -563,6 +1200,22 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	}
 	memset(info->i_maps, 0, size);
 
+	size = sizeof(unsigned long) * EMU3_TOTAL_ENTRIES(info);
+	info->d_maps = kzalloc(size, GFP_KERNEL);
+	if (!info->d_maps) {
+		err = -ENOMEM;
+		goto out4;
+	}
+
+	size =
+	    sizeof(unsigned long) * BITS_TO_LONGS(EMU3_TOTAL_ENTRIES(info));
+	info->i_maps_bitmap = kzalloc(size, GFP_KERNEL);
+	if (!info->i_maps_bitmap) {
+		err = -ENOMEM;
+		goto out4;
+	}
+	spin_lock_init(&info->i_maps_lock);
+
 	sb->s_op = &emu3_super_operations;
 	sb->s_xattr = emu3_xattr_handlers;
 
@@ -572,7 +1225,8 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 		root_ino =
 		    emu3_get_or_add_i_map(info, EMU3_DNUM
 					  (info->start_root_block, 0));
-	inode = emu3_get_inode(sb, root_ino);
+	inode = root_ino < 0 ? ERR_PTR(root_ino) :
+	    emu3_get_inode(sb, root_ino);
 	if (IS_ERR(inode)) {
 		err = -EIO;
 		goto out5;
@@ -589,7 +1243,7 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 
 	for (i = 0; i < info->root_blocks; i++) {
 		blknum = info->start_root_block + i;
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
@@ -597,7 +1251,7 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 			goto out5;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = (struct emu3_dentry *)EMU3_BLOCK_DATA(b, blknum);
 
 		if (i == 0 && emu3_fix_first_dir_blocks(e3d, info))
 			mark_buffer_dirty_inode(b, inode);
@@ -632,7 +1286,20 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	}
 
 	if (!err) {
-		mutex_init(&info->lock);
+		info->free_dir_content_blocks = 0;
+		for (i = 0; i < info->dir_content_blocks; i++)
+			if (!info->dir_content_block_list[i])
+				info->free_dir_content_blocks++;
+		info->free_inodes = emu3_get_free_inodes(sb);
+
+		init_rwsem(&info->lock);
+		init_rwsem(&info->cluster_lock);
+		emu3_debugfs_register(sb);
+		//The free space is found after mounting.
+		schedule_work(&info->scan_work);
+		if (info->commit_interval && !sb_rdonly(sb))
+			schedule_delayed_work(&info->commit_work,
+					      info->commit_interval * HZ);
 		brelse(sbh);
 		return 0;
 	}
@@ -641,8 +1308,13 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	kfree(info->dir_content_block_list);
  out4:
 	kfree(info->i_maps);
+	kfree(info->i_maps_bitmap);
+	kfree(info->d_maps);
  out3:
-	kfree(info->cluster_list);
+	kfree(info->discard_bitmap);
+	kfree(info->cluster_list_dirty);
+	kfree(info->cluster_bitmap);
+	emu3_free_cluster_pages(info);
  out2:
 	brelse(sbh);
  out1:
@@ -697,10 +1369,13 @@ static int __init emu3_init(void)
 	err = init_inodecache();
 	if (err)
 		return err;
+	emu3_debugfs_init();
 	err = register_filesystem(&emu3_fs_type_v3)
 	    || register_filesystem(&emu3_fs_type_v4);
-	if (err)
+	if (err) {
+		emu3_debugfs_exit();
 		destroy_inodecache();
+	}
 	return err;
 }
 
@@ -708,6 +1383,7 @@ static void __exit emu3_exit(void)
 {
 	unregister_filesystem(&emu3_fs_type_v3);
 	unregister_filesystem(&emu3_fs_type_v4);
+	emu3_debugfs_exit();
 	destroy_inodecache();
 	printk(KERN_INFO "%s: exit\n", EMU3_MODULE_NAME);
 }
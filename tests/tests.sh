@@ -22,6 +22,54 @@ function logAndRun() {
         return $err
 }
 
+#_IO('e', 1) and _IO('e', 2)
+EMU3_IOC_DEFRAG=0x6501
+EMU3_IOC_COMPACT=0x6502
+
+function emu3Ioctl() {
+        sudo python3 -c "import fcntl, os, sys; fd = os.open(sys.argv[2], os.O_RDONLY if os.path.isdir(sys.argv[2]) else os.O_RDWR); fcntl.ioctl(fd, int(sys.argv[1], 16))" $1 $2
+}
+
+#Reads the directory one entry at a time, seeking to the last position before each read, while an entry is created and a read one is removed between reads.
+#Fails if an entry is returned twice or an entry present all along is skipped.
+function emu3ReaddirWhileChanging() {
+        python3 - $1 <<'PYEOF'
+import ctypes, os, sys
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.opendir.restype = ctypes.c_void_p
+libc.readdir.restype = ctypes.c_void_p
+libc.readdir.argtypes = [ctypes.c_void_p]
+libc.telldir.restype = ctypes.c_long
+libc.telldir.argtypes = [ctypes.c_void_p]
+libc.seekdir.argtypes = [ctypes.c_void_p, ctypes.c_long]
+libc.closedir.argtypes = [ctypes.c_void_p]
+
+path = sys.argv[1]
+initial = set(os.listdir(path))
+seen = []
+d = libc.opendir(path.encode())
+i = 0
+while True:
+    libc.seekdir(d, libc.telldir(d))
+    e = libc.readdir(d)
+    if not e:
+        break
+    name = ctypes.string_at(e + 19).decode()
+    if name in (".", ".."):
+        continue
+    seen.append(name)
+    if i < 20:
+        open(os.path.join(path, "n-%d" % i), "w").close()
+    if i % 2:
+        os.unlink(os.path.join(path, seen[-2]))
+    i += 1
+libc.closedir(d)
+
+sys.exit(len(seen) != len(set(seen)) or not initial <= set(seen))
+PYEOF
+}
+
 function printTest() {
         printf "\033[1;34m*** Test: $* ***\033[0m\n"
         echo "emu3fs: *** Test: $* ***" | sudo tee /dev/kmsg
@@ -181,6 +229,16 @@ date | tee
 logAndRun diff $EMU3_MOUNTPOINT/foo/t3 $EMU3_MOUNTPOINT/foo/t4
 test
 
+logAndRun filefrag $EMU3_MOUNTPOINT/foo/t3
+test
+logAndRun '[[ "$out" =~ "extent" ]]'
+test
+
+logAndRun 'sudo cat /sys/kernel/debug/emu3fs/loop0/fragmentation'
+test
+logAndRun '[[ "$out" =~ "foo/t3" ]]'
+test
+
 logAndRun cp $EMU3_MOUNTPOINT/foo/t3 t3.bak
 test
 
@@ -196,6 +254,11 @@ test foo/t1
 logAndRun '[ 0 -eq $(wc -c $EMU3_MOUNTPOINT/foo/t1 | awk '\''{print $1}'\'') ]'
 test
 
+logAndRun truncate -s 2M $EMU3_MOUNTPOINT/foo/t1
+test foo/t1
+logAndRun cmp -n 2097152 $EMU3_MOUNTPOINT/foo/t1 /dev/zero
+test
+
 logAndRun '> $EMU3_MOUNTPOINT/foo/t3'
 logAndRun '[ $(stat --print "%s" $EMU3_MOUNTPOINT/foo/t3) -eq 0 ]'
 test
@@ -269,6 +332,128 @@ test
 logAndRun diff t6 $EMU3_MOUNTPOINT/foo/t6
 test
 
+printTest "fallocate"
+
+logAndRun fallocate -l 4M $EMU3_MOUNTPOINT/foo/t8
+test foo/t8
+logAndRun '[ 4194304 -eq $(stat --print "%s" $EMU3_MOUNTPOINT/foo/t8) ]'
+test
+logAndRun '[ 8192 -eq $(stat --print "%b" $EMU3_MOUNTPOINT/foo/t8) ]'
+test
+logAndRun '[ 0 -eq $(tr -d "\\000" < $EMU3_MOUNTPOINT/foo/t8 | wc -c) ]'
+test
+logAndRun fallocate -n -l 4M $EMU3_MOUNTPOINT/foo/t9
+test foo/t9
+logAndRun '[ 0 -eq $(stat --print "%s" $EMU3_MOUNTPOINT/foo/t9) ]'
+test
+logAndRun '[ 1024 -eq $(stat --print "%b" $EMU3_MOUNTPOINT/foo/t9) ]'
+test
+logAndRun rm $EMU3_MOUNTPOINT/foo/t8 $EMU3_MOUNTPOINT/foo/t9
+test
+
+printTest "Direct I/O"
+
+logAndRun dd if=t6 of=$EMU3_MOUNTPOINT/foo/t7 bs=64K oflag=direct status=none
+test foo/t7
+logAndRun diff t6 $EMU3_MOUNTPOINT/foo/t7
+test
+logAndRun dd if=$EMU3_MOUNTPOINT/foo/t7 of=t7 bs=64K iflag=direct status=none
+test
+logAndRun diff t6 t7
+test
+logAndRun rm t7 $EMU3_MOUNTPOINT/foo/t7
+test
+
+#Writes bigger than a cluster and appends starting a few blocks before a cluster boundary
+logAndRun 'head -c 3145728 </dev/urandom > t7'
+logAndRun dd if=t7 of=$EMU3_MOUNTPOINT/foo/t7 bs=1M oflag=direct status=none
+test foo/t7
+logAndRun diff t7 $EMU3_MOUNTPOINT/foo/t7
+test
+logAndRun dd if=t7 of=$EMU3_MOUNTPOINT/foo/t8 bs=512 count=1020 status=none
+test foo/t8
+logAndRun dd if=t7 of=$EMU3_MOUNTPOINT/foo/t8 bs=1M skip=522240 iflag=skip_bytes oflag=direct,append conv=notrunc status=none
+test foo/t8
+logAndRun diff t7 $EMU3_MOUNTPOINT/foo/t8
+test
+logAndRun rm t7 $EMU3_MOUNTPOINT/foo/t7 $EMU3_MOUNTPOINT/foo/t8
+test
+
+printTest "Defragmentation"
+
+#Appending to two files in turns leaves their clusters interleaved
+logAndRun 'head -c 4194304 </dev/urandom > t7'
+logAndRun 'head -c 4194304 </dev/urandom > t8'
+for i in $(seq 0 7); do
+  logAndRun dd if=t7 of=$EMU3_MOUNTPOINT/foo/t7 bs=512K skip=$i count=1 oflag=append conv=notrunc status=none
+  logAndRun dd if=t8 of=$EMU3_MOUNTPOINT/foo/t8 bs=512K skip=$i count=1 oflag=append conv=notrunc status=none
+done
+logAndRun sync
+logAndRun 'filefrag $EMU3_MOUNTPOINT/foo/t7 | grep -q ": 1 extent found"'
+testError foo/t7
+logAndRun 'md5sum < $EMU3_MOUNTPOINT/foo/t7'
+sum=$out
+logAndRun emu3Ioctl $EMU3_IOC_DEFRAG $EMU3_MOUNTPOINT/foo/t7
+test foo/t7
+logAndRun 'filefrag $EMU3_MOUNTPOINT/foo/t7 | grep -q ": 1 extent found"'
+test
+logAndRun 'md5sum < $EMU3_MOUNTPOINT/foo/t7'
+logAndRun '[ "$sum" == "$out" ]'
+test
+logAndRun diff t8 $EMU3_MOUNTPOINT/foo/t8
+test
+
+echo "Remounting..."
+logAndRun sudo umount $EMU3_MOUNTPOINT
+test
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun diff t7 $EMU3_MOUNTPOINT/foo/t7
+test
+logAndRun diff t8 $EMU3_MOUNTPOINT/foo/t8
+test
+
+#Removing a bank leaves a hole that compaction fills with the next ones
+logAndRun mkdir $EMU3_MOUNTPOINT/compact
+test compact
+for i in $(seq 1 4); do
+  logAndRun cp t6 $EMU3_MOUNTPOINT/compact/c$i
+  test compact/c$i
+done
+logAndRun rm $EMU3_MOUNTPOINT/compact/c2
+test compact
+logAndRun 'stat -f --print "%f" $EMU3_MOUNTPOINT'
+free=$out
+logAndRun 'sudo grep "largest free run" /sys/kernel/debug/emu3fs/loop0/fragmentation | awk '\''{print $4}'\'''
+largest=$out
+logAndRun emu3Ioctl $EMU3_IOC_COMPACT $EMU3_MOUNTPOINT/compact
+test compact
+logAndRun '[ $free -eq $(stat -f --print "%f" $EMU3_MOUNTPOINT) ]'
+test
+logAndRun 'sudo grep "largest free run" /sys/kernel/debug/emu3fs/loop0/fragmentation | awk '\''{print $4}'\'''
+logAndRun '[ $out -gt $largest ]'
+test
+for i in 1 3 4; do
+  logAndRun diff t6 $EMU3_MOUNTPOINT/compact/c$i
+  test compact/c$i
+done
+logAndRun diff t7 $EMU3_MOUNTPOINT/foo/t7
+test
+logAndRun diff t8 $EMU3_MOUNTPOINT/foo/t8
+test
+
+echo "Remounting..."
+logAndRun sudo umount $EMU3_MOUNTPOINT
+test
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+test
+for i in 1 3 4; do
+  logAndRun diff t6 $EMU3_MOUNTPOINT/compact/c$i
+  test compact/c$i
+done
+logAndRun rm -r t7 t8 $EMU3_MOUNTPOINT/foo/t7 $EMU3_MOUNTPOINT/foo/t8 $EMU3_MOUNTPOINT/compact
+test .
+
 logAndRun rm t5 t6
 
 printTest "Directory expansion"
@@ -300,6 +485,18 @@ test
 logAndRun rm -rf $EMU3_MOUNTPOINT/expansion
 test .
 
+printTest "Readdir while the directory changes"
+
+logAndRun mkdir $EMU3_MOUNTPOINT/readdir
+test .
+for i in $(seq 1 40); do
+        logAndRun touch $EMU3_MOUNTPOINT/readdir/f-${i}
+done
+logAndRun emu3ReaddirWhileChanging $EMU3_MOUNTPOINT/readdir
+test readdir
+logAndRun rm -rf $EMU3_MOUNTPOINT/readdir
+test .
+
 logAndRun mkdir $EMU3_MOUNTPOINT/src
 test .
 logAndRun mv $EMU3_MOUNTPOINT/src $EMU3_MOUNTPOINT/dst
@@ -405,6 +602,116 @@ testError
 logAndRun setfattr -n "user.bank.number" -v foo $EMU3_MOUNTPOINT/d2/t2
 testError
 
+printTest "Mount options"
+
+logAndRun sudo umount $EMU3_MOUNTPOINT
+test
+logAndRun sudo mount -t emu4 -o foo /dev/loop0 $EMU3_MOUNTPOINT
+testError
+logAndRun sudo mount -t emu4 -o iomap /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun 'grep $EMU3_MOUNTPOINT /proc/mounts | grep -q iomap'
+test
+
+logAndRun 'head -c 4567890 </dev/urandom > t7'
+logAndRun cp t7 $EMU3_MOUNTPOINT/d2
+test d2/t7
+logAndRun diff t7 $EMU3_MOUNTPOINT/d2/t7
+test
+logAndRun '[ 9216 -eq $(stat --print "%b" $EMU3_MOUNTPOINT/d2/t7) ]'
+test
+
+echo "Remounting..."
+logAndRun sudo umount $EMU3_MOUNTPOINT
+test
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun diff t7 $EMU3_MOUNTPOINT/d2/t7
+test
+logAndRun rm $EMU3_MOUNTPOINT/d2/t7
+test
+
+for opts in delalloc iomap,delalloc commit=1 discard; do
+  logAndRun sudo umount $EMU3_MOUNTPOINT
+  test
+  logAndRun sudo mount -t emu4 -o $opts /dev/loop0 $EMU3_MOUNTPOINT
+  test
+  logAndRun cp t7 $EMU3_MOUNTPOINT/d2
+  test d2/t7
+  logAndRun sync
+  logAndRun '[ 9216 -eq $(stat --print "%b" $EMU3_MOUNTPOINT/d2/t7) ]'
+  test
+  logAndRun sudo umount $EMU3_MOUNTPOINT
+  test
+  logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+  test
+  logAndRun diff t7 $EMU3_MOUNTPOINT/d2/t7
+  test
+  logAndRun rm $EMU3_MOUNTPOINT/d2/t7
+  test
+done
+logAndRun rm t7
+
+logAndRun sudo fstrim $EMU3_MOUNTPOINT
+test
+
+logAndRun sudo umount $EMU3_MOUNTPOINT
+logAndRun sudo losetup -d /dev/loop0
+echo
+
+printTest "2 KiB sectors"
+
+#The data area of the image starts at block 115, which is not aligned to 2 KiB
+logAndRun sudo losetup --sector-size 2048 /dev/loop0 image.iso
+test
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+testError
+logAndRun sudo losetup -d /dev/loop0
+
+#Moving it to block 116 aligns it
+logAndRun 'printf "\x74\x00\x00\x00" | dd of=image.iso bs=1 seek=32 conv=notrunc status=none'
+logAndRun sudo losetup --sector-size 2048 /dev/loop0 image.iso
+test
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun mkdir $EMU3_MOUNTPOINT/sectors
+test .
+
+logAndRun 'head -c 4567890 </dev/urandom > t7'
+logAndRun cp t7 $EMU3_MOUNTPOINT/sectors
+test sectors/t7
+logAndRun diff t7 $EMU3_MOUNTPOINT/sectors/t7
+test
+logAndRun '[ 9216 -eq $(stat --print "%b" $EMU3_MOUNTPOINT/sectors/t7) ]'
+test
+logAndRun filefrag $EMU3_MOUNTPOINT/sectors/t7
+test
+logAndRun '[[ "$out" =~ "extent" ]]'
+test
+
+logAndRun truncate -s 2M $EMU3_MOUNTPOINT/sectors/t8
+test sectors/t8
+logAndRun cmp -n 2097152 $EMU3_MOUNTPOINT/sectors/t8 /dev/zero
+test
+logAndRun truncate -s 1234567 $EMU3_MOUNTPOINT/sectors/t7
+test sectors/t7
+logAndRun cmp -n 1234567 t7 $EMU3_MOUNTPOINT/sectors/t7
+test
+
+echo "Remounting..."
+logAndRun sudo umount $EMU3_MOUNTPOINT
+test
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun cmp -n 1234567 t7 $EMU3_MOUNTPOINT/sectors/t7
+test
+logAndRun '[ 1234567 -eq $(stat --print "%s" $EMU3_MOUNTPOINT/sectors/t7) ]'
+test
+logAndRun cmp -n 2097152 $EMU3_MOUNTPOINT/sectors/t8 /dev/zero
+test
+logAndRun rm -r t7 $EMU3_MOUNTPOINT/sectors
+test .
+
 logAndRun sudo umount $EMU3_MOUNTPOINT
 logAndRun sudo losetup -d /dev/loop0
 echo
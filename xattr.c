@@ -34,19 +34,11 @@ static int emu3_xattr_get(const struct xattr_handler *handler,
 			  struct dentry *dentry, struct inode *inode,
 			  const char *name, void *buffer, size_t size)
 {
-	int ret;
-	struct emu3_inode *e3i;
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
-
 	if (strcmp(name, EMU3_XATTR_BNUM))
 		return -ENODATA;
 
-	mutex_lock(&info->lock);
-	e3i = EMU3_I(inode);
-	ret = snprintf(buffer, size, "%d", e3i->data.id);
-	mutex_unlock(&info->lock);
-
-	return ret;
+	//The cached id is a single byte so no lock is needed to read it.
+	return snprintf(buffer, size, "%d", READ_ONCE(EMU3_I(inode)->data.id));
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
@@ -64,6 +56,7 @@ static int emu3_xattr_set(const struct xattr_handler *handler,
 {
 	long bn;
 	int ret;
+	struct dentry *parent;
 	struct buffer_head *b;
 	struct emu3_dentry *e3d;
 	struct emu3_inode *e3i;
@@ -88,15 +81,18 @@ static int emu3_xattr_set(const struct xattr_handler *handler,
 		return -ERANGE;
 	}
 
-	mutex_lock(&info->lock);
+	parent = dget_parent(dentry);
+	down_write(&info->lock);
 	e3i = EMU3_I(inode);
-	e3i->data.id = bn;
+	WRITE_ONCE(e3i->data.id, bn);
 	mark_inode_dirty(inode);
 	e3d = emu3_find_dentry_by_inode(inode, &b);
 	e3d->data.id = bn;
 	mark_buffer_dirty_inode(b, inode);
 	brelse(b);
-	mutex_unlock(&info->lock);
+	emu3_dir_index_set_id(d_inode(parent), emu3_get_i_map(info, inode), bn);
+	up_write(&info->lock);
+	dput(parent);
 
 	return ret;
 }